@@ -0,0 +1,248 @@
+// Counts heap allocations of kasa's requests and hot functions over a synthetic workload (see workload.h), with
+// global operator new interposed. Additions and tariff changes, which only ever happen once, are counted one by one
+// as the network is built. The rest of the lines are then handled in batches, just as the program handles them,
+// and counted per batch in steady state - once the arenas and buffers have grown.
+// Results are printed as JSON; the exit status is 1 if any request or call allocated more times than its budget.
+#include "workload.h"
+
+#include "../kasa.cc"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+    // Number and total size of allocations.
+    using AllocationCounts = std::pair<std::uint64_t, std::uint64_t>;
+
+    // Allocations made since the program started; the harness is single-threaded.
+    AllocationCounts allocationCounts;
+
+    // Allocations of a kind of request or of a function - number of calls, allocations and bytes allocated by all of
+    // them, and the most allocations made by a single call.
+    using AllocationStats = std::tuple<std::uint64_t, std::uint64_t, std::uint64_t, std::uint64_t>;
+
+    // Adds the allocations made since the counts were taken, by a single call, to the stats.
+    void addAllocations(AllocationStats& stats, const AllocationCounts& before) {
+        auto& [calls, allocations, bytes, maxAllocations] = stats;
+        std::uint64_t callAllocations = allocationCounts.first - before.first;
+
+        calls ++;
+        allocations += callAllocations;
+        bytes += allocationCounts.second - before.second;
+        maxAllocations = std::max(maxAllocations, callAllocations);
+    }
+
+    template<typename Call>
+    auto countAllocations(AllocationStats& stats, Call call) {
+        AllocationCounts before = allocationCounts;
+        auto result = call();
+        addAllocations(stats, before);
+
+        return result;
+    }
+
+    std::string statsToJson(const std::string& name, const AllocationStats& stats) {
+        const auto& [calls, allocations, bytes, maxAllocations] = stats;
+        char buffer[256];
+        std::snprintf(buffer, sizeof(buffer), "\"%s\": {\"calls\": %llu, \"allocations\": %llu, \"bytes\": %llu, "
+                "\"max_allocations\": %llu}", name.c_str(), static_cast<unsigned long long>(calls),
+                static_cast<unsigned long long>(allocations), static_cast<unsigned long long>(bytes),
+                static_cast<unsigned long long>(maxAllocations));
+        return buffer;
+    }
+
+    // Discards everything written, so that printing is counted but the terminal is not.
+    Output createNullOutput(std::ostream& nullStream) {
+        Output output = createOutput(false);
+        for (auto& channel : std::get<0>(output)) {
+            channel.first = &nullStream;
+        }
+        return output;
+    }
+
+    // Errors are counted apart from the requests that caused them, whether they were rejected by parsing or not.
+    inline RequestType getCountedType(std::string_view line, const ProcessResult& processResult) {
+        return (processResult.first == ERROR_RESP) ? ERROR_REQ : getRequestType(line);
+    }
+
+    // Handles the lines just as a batch would, counting allocations of every line along with printing its
+    // response. The scratch arena is released once per batch, as processBatch's callers do.
+    void handleLines(const workload::Lines& lines, Network& network, ScratchArena& scratchArena, Output& output,
+            std::vector<AllocationStats>& requestStats) {
+        unsigned int ticketCounter = 0, lineCounter = 1;
+        std::pmr::memory_resource* scratch = scratchArena.second.get();
+
+        for (std::size_t i = 0; i < lines.size(); i ++) {
+            std::string_view line = lines[i];
+            AllocationCounts before = allocationCounts;
+            ProcessResult processResult = isReadOnlyRequest(getRequestType(line))
+                ? handleQueryLine(line, network, ticketCounter, nullptr, scratch, nullptr, nullptr)
+                : handleLine(line, network, ticketCounter, scratch, nullptr);
+            printOutput(processResult, line, lineCounter ++, output);
+            addAllocations(requestStats[getCountedType(line, processResult)], before);
+
+            if ((i + 1) % inputBatchSize == 0) {
+                scratchArena.second->release();
+            }
+        }
+        scratchArena.second->release();
+    }
+
+    // Handles the lines in batches through processBatch, counting allocations of every batch along with printing
+    // its responses and releasing the arenas, just as the program's batch loop does.
+    void handleBatches(const workload::Lines& lines, std::size_t begin, Network& network, QueryWorkers& queryWorkers,
+            std::vector<QueryCache>& queryCaches, std::vector<ScratchArena>& scratchArenas,
+            std::vector<ProcessResult>& processResults, InputBatch& batch, Output& output,
+            AllocationStats& batchStats) {
+        unsigned int ticketCounter = 0, lineCounter = 1;
+
+        for (std::size_t batchBegin = begin; batchBegin < lines.size(); batchBegin += inputBatchSize) {
+            std::size_t batchEnd = std::min(lines.size(), batchBegin + inputBatchSize);
+            AllocationCounts before = allocationCounts;
+            batch.assign(lines.begin() + batchBegin, lines.begin() + batchEnd);
+            processBatch(batch, network, queryWorkers, processResults, ticketCounter, queryCaches, scratchArenas,
+                    nullptr, nullptr);
+            for (std::size_t i = 0; i < batch.size(); i ++) {
+                printOutput(processResults[i], batch[i], lineCounter ++, output);
+            }
+            releaseScratchArenas(scratchArenas, processResults);
+            addAllocations(batchStats, before);
+        }
+    }
+}
+
+void* operator new(std::size_t size) {
+    allocationCounts.first ++;
+    allocationCounts.second += size;
+    if (void* pointer = std::malloc(size > 0 ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    allocationCounts.first ++;
+    allocationCounts.second += size;
+    auto align = static_cast<std::size_t>(alignment);
+    if (void* pointer = std::aligned_alloc(align, (std::max<std::size_t>(size, 1) + align - 1) / align * align)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+int main(int argc, char* argv[]) {
+    // Requests counted one by one, along with their names and budgets.
+    static const std::array<RequestType, 4> changeTypes = {ADD_ROUTE, ADD_TICKET, REMOVE_TICKET, REPRICE_TICKET};
+    static const std::array<const char*, 4> typeNames = {"ADD_ROUTE", "ADD_TICKET", "REMOVE_TICKET", "REPRICE_TICKET"};
+    static const std::array<const char*, 4> budgetNames = {
+        "budget-add-route", "budget-add-ticket", "budget-remove-ticket", "budget-reprice-ticket"
+    };
+
+    // Budgets limit the allocations of a single request or call; hot paths allocate nothing once warmed up.
+    workload::Params params = workload::defaultParams();
+    for (const char* budgetName : budgetNames) {
+        params[budgetName] = ULLONG_MAX;
+    }
+    // Journey searches start in a stack buffer, which the largest of them outgrow by a chunk or so; nothing else in a
+    // batch allocates.
+    params["budget-process-batch"] = 2;
+    // Tariff changes leave the arena alone; a reprice may start the list of a covered time no ticket had.
+    params["budget-remove-ticket"] = 0;
+    params["budget-reprice-ticket"] = 2;
+    params["budget-count-travel-time"] = 0;
+    params["budget-select-tickets"] = 0;
+    // Every kind of request is measured, tariff changes and plans included.
+    params["reprice-tickets"] = 20;
+    params["remove-tickets"] = 10;
+    params["plan-percent"] = 5;
+    if (! workload::parseParams(argc, argv, params)) {
+        std::cerr << "Usage: " << argv[0] << " [--name=value]... with defaults " << workload::paramsToJson(params)
+            << std::endl;
+        return 1;
+    }
+
+    workload::Lines lines = workload::generate(params);
+    std::size_t addedLineCount = params["routes"] + params["tickets"] + params["reprice-tickets"]
+        + params["remove-tickets"];
+    std::ostream nullStream(nullptr);
+    Output output = createNullOutput(nullStream);
+    // A single worker, as the counts are not synchronized; its cache is set up as the program sets it up by default.
+    std::vector<ScratchArena> scratchArenas = createScratchArenas(1);
+    QueryWorkers queryWorkers = createQueryWorkers(1);
+    std::vector<QueryCache> queryCaches = createQueryCaches(defaultQueryCacheCapacity, 1);
+    std::vector<ProcessResult> processResults;
+    InputBatch batch;
+
+    // The network is built as part of the first run, whose other lines only warm up, and so does the first run of
+    // batches; the second run of batches counts them.
+    std::vector<AllocationStats> requestStats(requestTypeCount);
+    AllocationStats batchStats, warmUpBatchStats;
+    std::pmr::monotonic_buffer_resource networkArena;
+    Network network = createNetwork(&networkArena, defaultTicketLimit, defaultServiceWindow);
+    handleLines(lines, network, scratchArenas[0], output, requestStats);
+    handleBatches(lines, addedLineCount, network, queryWorkers, queryCaches, scratchArenas, processResults, batch,
+            output, warmUpBatchStats);
+    handleBatches(lines, addedLineCount, network, queryWorkers, queryCaches, scratchArenas, processResults, batch,
+            output, batchStats);
+
+    std::pmr::monotonic_buffer_resource* scratch = scratchArenas[0].second.get();
+    AllocationStats countTravelTimeStats, selectTicketsStats;
+    for (std::size_t i = addedLineCount; i < lines.size(); i ++) {
+        ParseResult parseResult = parseInputLine(lines[i], network, scratch);
+        if (parseResult.first != QUERY) {
+            continue;
+        }
+
+        auto countingResult = countAllocations(countTravelTimeStats, [&]() {
+            return countTravelTime(std::get<Query>(parseResult.second.value()), std::get<Timetable>(network));
+        });
+        if (countingResult.first == TRAVEL_TIME_FOUND) {
+            countAllocations(selectTicketsStats, [&]() {
+                return selectTickets(getUntaggedTicketTable(network), std::get<TicketCatalog>(network),
+                        std::get<StopTime>(countingResult.second.value()), scratch).size();
+            });
+        }
+        scratch->release();
+    }
+
+    std::vector<std::tuple<std::string, AllocationStats, unsigned long long>> results;
+    for (std::size_t i = 0; i < changeTypes.size(); i ++) {
+        if (std::get<0>(requestStats[changeTypes[i]]) > 0) {
+            results.emplace_back(typeNames[i], requestStats[changeTypes[i]], params[budgetNames[i]]);
+        }
+    }
+    results.emplace_back("processBatch", batchStats, params["budget-process-batch"]);
+    results.emplace_back("countTravelTime", countTravelTimeStats, params["budget-count-travel-time"]);
+    results.emplace_back("selectTickets", selectTicketsStats, params["budget-select-tickets"]);
+
+    bool withinBudgets = true;
+    std::cout << "{\"params\": " << workload::paramsToJson(params) << ", \"results\": {";
+    for (std::size_t i = 0; i < results.size(); i ++) {
+        const auto& [name, stats, budget] = results[i];
+        std::cout << (i > 0 ? ", " : "") << statsToJson(name, stats);
+        if (std::get<3>(stats) > budget) {
+            std::cerr << name << " made " << std::get<3>(stats) << " allocations in a single call, over its budget of "
+                << budget << std::endl;
+            withinBudgets = false;
+        }
+    }
+    std::cout << "}}" << std::endl;
+
+    return withinBudgets ? 0 : 1;
+}
@@ -0,0 +1,263 @@
+// Microbenchmarks of kasa's stages and an end-to-end throughput measurement over a synthetic workload
+// (see workload.h). Results are printed as JSON, so that they can be compared between releases.
+#include "workload.h"
+
+#include "../kasa.cc"
+
+#include <chrono>
+
+namespace {
+    // Measurement of a benchmark - its name, number of operations performed and time taken (in seconds).
+    using BenchResult = std::tuple<std::string, std::size_t, double>;
+
+    // Keeps the compiler from dropping computations whose results are otherwise unused.
+    volatile std::size_t benchSink;
+
+    // Repeats the run (performing the given number of operations) until it has taken at least minSeconds.
+    template<typename Run>
+    BenchResult measure(const std::string& name, std::size_t operationsPerRun, double minSeconds, Run run) {
+        using Clock = std::chrono::steady_clock;
+        std::size_t operations = 0;
+        double seconds = 0;
+
+        while (seconds < minSeconds || operations == 0) {
+            auto start = Clock::now();
+            benchSink = benchSink + run();
+            seconds += std::chrono::duration<double>(Clock::now() - start).count();
+            operations += operationsPerRun;
+        }
+
+        return BenchResult(name, operations, seconds);
+    }
+
+    std::string resultToJson(const BenchResult& result) {
+        const auto& [name, operations, seconds] = result;
+        char buffer[256];
+        std::snprintf(buffer, sizeof(buffer),
+                "{\"name\": \"%s\", \"operations\": %zu, \"seconds\": %.6f, \"ns_per_op\": %.2f, "
+                "\"ops_per_second\": %.0f}", name.c_str(), operations, seconds, 1e9 * seconds / operations,
+                operations / seconds);
+        return buffer;
+    }
+
+    // Discards everything written, so that the end-to-end run measures formatting but not the terminal.
+    Output createNullOutput(std::ostream& nullStream) {
+        Output output = createOutput(false);
+        for (auto& channel : std::get<0>(output)) {
+            channel.first = &nullStream;
+        }
+        return output;
+    }
+
+    void loadNetwork(const workload::Lines& lines, Network& network) {
+        unsigned int ticketCounter = 0;
+        for (const auto& line : lines) {
+            ParseResult parseResult = parseInputLine(line, network, std::pmr::get_default_resource());
+            if (parseResult.first == ADD_ROUTE || parseResult.first == ADD_TICKET) {
+                processRequest(parseResult, network, ticketCounter, std::pmr::get_default_resource());
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    workload::Params params = workload::defaultParams();
+    params["min-millis"] = 500;
+    params["threads"] = 1;
+    params["networks"] = 4;
+    if (! workload::parseParams(argc, argv, params) || params["threads"] == 0) {
+        std::cerr << "Usage: " << argv[0] << " [--name=value]... with defaults " << workload::paramsToJson(params)
+            << std::endl;
+        return 1;
+    }
+
+    double minSeconds = params["min-millis"] / 1000.0;
+    auto workerCount = static_cast<unsigned int>(params["threads"]);
+    workload::Lines lines = workload::generate(params);
+    std::vector<BenchResult> results;
+
+    Network network = createNetwork(std::pmr::get_default_resource(), defaultTicketLimit, defaultServiceWindow);
+    loadNetwork(lines, network);
+
+    std::vector<Query> queries;
+    for (const auto& line : lines) {
+        ParseResult parseResult = parseInputLine(line, network, std::pmr::get_default_resource());
+        if (parseResult.first == QUERY) {
+            queries.push_back(std::move(std::get<Query>(parseResult.second.value())));
+        }
+    }
+
+    std::vector<ScratchArena> scratchArenas = createScratchArenas(workerCount);
+    QueryWorkers queryWorkers = createQueryWorkers(workerCount);
+    std::pmr::monotonic_buffer_resource* scratch = scratchArenas[0].second.get();
+    results.push_back(measure("parse", lines.size(), minSeconds, [&]() {
+        std::size_t accepted = 0;
+        for (const auto& line : lines) {
+            accepted += (parseInputLine(line, network, scratch).first != ERROR_REQ);
+            scratch->release();
+        }
+        return accepted;
+    }));
+
+    results.push_back(measure("countTravelTime", queries.size(), minSeconds, [&]() {
+        std::size_t found = 0;
+        for (const auto& query : queries) {
+            found += (countTravelTime(query, std::get<Timetable>(network)).first == TRAVEL_TIME_FOUND);
+        }
+        return found;
+    }));
+
+    results.push_back(measure("selectTickets", defaultMaxTravelTime + 1, minSeconds, [&]() {
+        std::size_t selected = 0;
+        for (StopTime totalTime = 0; totalTime <= defaultMaxTravelTime; totalTime ++) {
+            selected += selectTickets(getUntaggedTicketTable(network), std::get<TicketCatalog>(network),
+                    totalTime, scratch).size();
+            scratch->release();
+        }
+        return selected;
+    }));
+
+    // Every ticket that is part of some cheapest set is made a hundred times dearer and then given its price back, so
+    // that the sets it was part of have to be recomputed without it. The other tickets cost no recomputation.
+    std::vector<AddTicket> loadedTickets;
+    const auto& ticketCatalog = std::get<TicketCatalog>(network);
+    for (TicketId id = 0; id < ticketCatalog.size(); id ++) {
+        const auto& [name, price, validTime, fareClassId] = ticketCatalog[id];
+        const auto& ticketLayers = std::get<TicketSelectionTable>(std::get<FareClasses>(network)[fareClassId]).first;
+        bool isInSet = std::any_of(ticketLayers.begin(), ticketLayers.end(), [id](const auto& layer) {
+            return std::any_of(layer.begin(), layer.end(), [id](const auto& set) { return isTicketInSet(set, id); });
+        });
+        if (isInSet) {
+            loadedTickets.emplace_back(name, price, validTime,
+                    std::get<0>(std::get<FareClasses>(network)[fareClassId]));
+        }
+    }
+    TicketEpoch ticketEpoch = 0;
+    results.push_back(measure("repriceTicket", 2 * loadedTickets.size(), minSeconds, [&]() {
+        std::size_t repriced = 0;
+        for (const auto& loadedTicket : loadedTickets) {
+            AddTicket dearerTicket = loadedTicket;
+            std::get<1>(dearerTicket) *= 100;
+            repriced += (processRepriceTicket(dearerTicket, std::get<TicketCatalog>(network),
+                        std::get<FareClasses>(network), ticketEpoch).first != ERROR_RESP);
+            repriced += (processRepriceTicket(loadedTicket, std::get<TicketCatalog>(network),
+                        std::get<FareClasses>(network), ticketEpoch).first != ERROR_RESP);
+        }
+        return repriced;
+    }));
+
+    // The same tickets are removed and added back right away, so that each run starts from the same sets; the time
+    // includes the additions.
+    results.push_back(measure("removeTicket", loadedTickets.size(), minSeconds, [&]() {
+        std::size_t removed = 0;
+        for (const auto& loadedTicket : loadedTickets) {
+            const auto& [name, price, validTime, tag] = loadedTicket;
+            removed += (processRemoveTicket(RemoveTicket(name, tag), std::get<TicketCatalog>(network),
+                        std::get<FareClasses>(network), ticketEpoch).first != ERROR_RESP);
+            processAddTicket(loadedTicket, std::get<TicketCatalog>(network), std::get<FareClasses>(network),
+                    ticketEpoch);
+        }
+        return removed;
+    }));
+
+    // The same queries through the typed interface, with no text on either side.
+    kasa::EngineHandle engine = kasa::createEngine();
+    loadNetwork(lines, engine->network);
+    std::vector<kasa::Query> typedQueries;
+    for (const auto& query : queries) {
+        auto& typedQuery = typedQueries.emplace_back();
+        for (const auto& [stopName, lineNum, stopId] : query) {
+            typedQuery.emplace_back(stopId, lineNum);
+        }
+    }
+    std::vector<kasa::Solution> solutions(typedQueries.size());
+    results.push_back(measure("solve", typedQueries.size(), minSeconds, [&]() {
+        kasa::solve(*engine, typedQueries.data(), typedQueries.size(), solutions.data());
+        return static_cast<std::size_t>(std::count_if(solutions.begin(), solutions.end(),
+                [](const auto& solution) { return std::get<0>(solution) == kasa::SOLUTION_FOUND; }));
+    }));
+
+    std::ostream nullStream(nullptr);
+    results.push_back(measure("end_to_end_lines", lines.size(), minSeconds, [&]() {
+        std::pmr::monotonic_buffer_resource networkArena;
+        Network freshNetwork = createNetwork(&networkArena, defaultTicketLimit, defaultServiceWindow);
+        Output output = createNullOutput(nullStream);
+        std::vector<ProcessResult> processResults;
+        std::vector<QueryCache> queryCaches = createQueryCaches(defaultQueryCacheCapacity, workerCount);
+        InputBatch batch;
+        unsigned int ticketCounter = 0, lineCounter = 1;
+
+        for (std::size_t begin = 0; begin < lines.size(); begin += inputBatchSize) {
+            batch.assign(lines.begin() + begin, lines.begin() + std::min(lines.size(), begin + inputBatchSize));
+            processBatch(batch, freshNetwork, queryWorkers, processResults, ticketCounter, queryCaches, scratchArenas,
+                    nullptr, nullptr);
+            for (std::size_t i = 0; i < batch.size(); i ++) {
+                printOutput(processResults[i], batch[i], lineCounter ++, output);
+            }
+            releaseScratchArenas(scratchArenas, processResults);
+        }
+        printTicketCount(ticketCounter, output);
+        flushOutput(output);
+
+        return static_cast<std::size_t>(ticketCounter);
+    }));
+
+    // The same run through the pipeline, with as many parsers as there are threads.
+    results.push_back(measure("end_to_end_pipeline_lines", lines.size(), minSeconds, [&]() {
+        std::pmr::monotonic_buffer_resource networkArena;
+        Network freshNetwork = createNetwork(&networkArena, defaultTicketLimit, defaultServiceWindow);
+        Output output = createNullOutput(nullStream);
+        unsigned int ticketCounter = 0, lineCounter = 1;
+
+        auto forEachBatch = [&lines](auto handleBatch) {
+            InputBatch batch;
+            for (std::size_t begin = 0; begin < lines.size(); begin += inputBatchSize) {
+                batch.assign(lines.begin() + begin, lines.begin() + std::min(lines.size(), begin + inputBatchSize));
+                handleBatch(batch);
+            }
+        };
+        runPipeline(forEachBatch, workerCount, freshNetwork, ticketCounter, lineCounter, output, nullptr, nullptr,
+                nullptr);
+        printTicketCount(ticketCounter, output);
+        flushOutput(output);
+
+        return static_cast<std::size_t>(ticketCounter);
+    }));
+
+    // The workload of every network of a sharded run at once, line by line, with a shard for every network (and
+    // an idle one for the default network). Every line is tagged, so the merged output is tagged as well.
+    std::vector<std::string> networkNames;
+    for (unsigned long long network = 0; network < params["networks"]; network ++) {
+        networkNames.push_back(workload::stopName(network));
+    }
+    std::vector<std::string_view> networkNameViews(networkNames.begin(), networkNames.end());
+    workload::Lines shardedLines;
+    for (const auto& line : lines) {
+        for (const auto& name : networkNames) {
+            shardedLines.push_back("[" + name + "] " + line);
+        }
+    }
+    results.push_back(measure("end_to_end_sharded_lines", shardedLines.size(), minSeconds, [&]() {
+        std::vector<Output> outputs(1, createNullOutput(nullStream));
+        auto forEachBatch = [&shardedLines](auto handleBatch) {
+            InputBatch batch;
+            for (std::size_t begin = 0; begin < shardedLines.size(); begin += inputBatchSize) {
+                batch.assign(shardedLines.begin() + begin,
+                        shardedLines.begin() + std::min(shardedLines.size(), begin + inputBatchSize));
+                handleBatch(batch);
+            }
+        };
+        runShards(forEachBatch, networkNameViews, defaultTicketLimit, defaultServiceWindow, outputs);
+        flushOutput(outputs[0]);
+
+        return shardedLines.size();
+    }));
+
+    std::cout << "{\"params\": " << workload::paramsToJson(params) << ", \"results\": [";
+    for (std::size_t i = 0; i < results.size(); i ++) {
+        std::cout << (i > 0 ? ", " : "") << resultToJson(results[i]);
+    }
+    std::cout << "]}" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+// Prints a synthetic kasa input; see workload.h for the parameters.
+#include "workload.h"
+
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+
+    workload::Params params = workload::defaultParams();
+    if (! workload::parseParams(argc, argv, params)) {
+        std::cerr << "Usage: " << argv[0] << " [--name=value]... with defaults " << workload::paramsToJson(params)
+            << std::endl;
+        return 1;
+    }
+
+    for (const auto& line : workload::generate(params)) {
+        std::cout << line << '\n';
+    }
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+#ifndef KASA_BENCH_WORKLOAD_H
+#define KASA_BENCH_WORKLOAD_H
+
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Synthetic input for kasa: routes chained by exact-time transfers, a ticket catalog, and a mix of valid,
+// waiting and invalid lines. Everything is derived from the seed, so a workload can be reproduced exactly.
+namespace workload {
+    // Workload parameters by name.
+    using Params = std::map<std::string, unsigned long long>;
+    // Stops of a generated route - stop indices along with arrival times, in order of travel.
+    using GeneratedRoute = std::vector<std::pair<std::size_t, unsigned int>>;
+    // Generated input lines.
+    using Lines = std::vector<std::string>;
+
+    inline Params defaultParams() {
+        return {
+            {"seed", 1},
+            {"routes", 1000},
+            {"stops", 2000},
+            {"stops-per-route", 20},
+            {"tickets", 100},
+            // Tariff changes applied once the catalog is added - tickets repriced and, of the last ones, removed.
+            {"reprice-tickets", 0},
+            {"remove-tickets", 0},
+            {"query-legs", 3},
+            {"lines", 100000},
+            // Percentages of the query lines; the rest is invalid.
+            {"valid-percent", 80},
+            {"wait-percent", 10},
+            {"plan-percent", 0}
+        };
+    }
+
+    // Overrides the defaults with "--name=value" arguments; returns false on an unknown or malformed one.
+    inline bool parseParams(int argc, char* argv[], Params& params) {
+        for (int i = 1; i < argc; i ++) {
+            std::string_view argument = argv[i];
+            std::size_t separator = argument.find('=');
+            if (argument.substr(0, 2) != "--" || separator == std::string_view::npos) {
+                return false;
+            }
+
+            std::string name(argument.substr(2, separator - 2));
+            if (params.find(name) == params.end()) {
+                return false;
+            }
+
+            try {
+                params[name] = std::stoull(std::string(argument.substr(separator + 1)));
+            } catch (std::exception&) {
+                return false;
+            }
+        }
+
+        return (params["stops"] >= params["stops-per-route"] && params["stops-per-route"] >= 2
+                && params["routes"] > 0 && params["query-legs"] > 0
+                && params["remove-tickets"] <= params["tickets"]
+                && (params["reprice-tickets"] == 0 || params["tickets"] > 0)
+                && params["valid-percent"] + params["wait-percent"] + params["plan-percent"] <= 100);
+    }
+
+    inline std::string paramsToJson(const Params& params) {
+        std::string json = "{";
+        for (const auto& [name, value] : params) {
+            json += (json.size() > 1 ? ", \"" : "\"") + name + "\": " + std::to_string(value);
+        }
+        return json + "}";
+    }
+
+    // Stop names may only consist of letters, so indices are spelled in base 26.
+    inline std::string stopName(std::size_t stop) {
+        std::string name = "S";
+        do {
+            name += static_cast<char>('a' + stop % 26);
+            stop /= 26;
+        } while (stop > 0);
+        return name;
+    }
+
+    inline std::string timeToString(unsigned int time) {
+        char buffer[16];
+        std::snprintf(buffer, sizeof(buffer), "%u:%02u", time / 60, time % 60);
+        return buffer;
+    }
+
+    // Line numbers of generated routes are their indices plus one.
+    inline std::string routeLine(std::size_t route, const GeneratedRoute& stops) {
+        std::string line = std::to_string(route + 1);
+        for (const auto& [stop, time] : stops) {
+            line += " " + timeToString(time) + " " + stopName(stop);
+        }
+        return line;
+    }
+
+    // Every route but the first starts where and when some earlier route passes, so journeys can transfer.
+    inline std::vector<GeneratedRoute> generateRoutes(const Params& params, std::mt19937_64& random) {
+        static const unsigned int firstTime = 355, lastTime = 1281;
+        std::size_t stopCount = params.at("stops"), stopsPerRoute = params.at("stops-per-route");
+        std::vector<GeneratedRoute> routes;
+
+        for (std::size_t route = 0; route < params.at("routes"); route ++) {
+            GeneratedRoute stops;
+            if (route > 0) {
+                const auto& parent = routes[random() % route];
+                stops.push_back(parent[random() % parent.size()]);
+            } else {
+                stops.emplace_back(random() % stopCount, firstTime + random() % 60);
+            }
+
+            while (stops.size() < stopsPerRoute && stops.back().second < lastTime) {
+                std::size_t stop = random() % stopCount;
+                bool repeated = false;
+                for (const auto& visited : stops) {
+                    repeated = repeated || (visited.first == stop);
+                }
+                if (! repeated) {
+                    stops.emplace_back(stop, std::min(lastTime, stops.back().second + 1 + unsigned(random() % 8)));
+                }
+            }
+
+            routes.push_back(std::move(stops));
+        }
+
+        return routes;
+    }
+
+    // A journey along routes connected with exact-time transfers; with wait set, the last transfer takes
+    // a route passing the stop later, so the passenger would have to wait.
+    inline std::string queryLine(const std::vector<GeneratedRoute>& routes,
+            const std::multimap<std::size_t, std::pair<std::size_t, std::size_t>>& routesByStop,
+            std::size_t legCount, bool wait, std::mt19937_64& random) {
+        std::size_t route = random() % routes.size();
+        std::size_t position = random() % routes[route].size();
+        std::string line = "?";
+
+        for (std::size_t leg = 0; leg < legCount; leg ++) {
+            const auto& stops = routes[route];
+            std::size_t end = position + random() % (stops.size() - position);
+            line += " " + stopName(stops[position].first) + " " + std::to_string(route + 1);
+
+            auto [first, last] = routesByStop.equal_range(stops[end].first);
+            std::vector<std::pair<std::size_t, std::size_t>> next;
+            bool lastLeg = (leg + 1 == legCount);
+            for (auto it = first; it != last; it ++) {
+                const auto& [nextRoute, nextPosition] = it->second;
+                unsigned int departure = routes[nextRoute][nextPosition].second;
+                if (nextRoute != route && ((wait && lastLeg) ? departure > stops[end].second
+                        : departure == stops[end].second)) {
+                    next.push_back(it->second);
+                }
+            }
+
+            if (next.empty() || (lastLeg && ! wait)) {
+                return line + " " + stopName(stops[end].first);
+            }
+
+            std::tie(route, position) = next[random() % next.size()];
+            if (lastLeg) {
+                const auto& nextStops = routes[route];
+                return line + " " + stopName(nextStops[position].first) + " " + std::to_string(route + 1) + " "
+                    + stopName(nextStops[position + random() % (nextStops.size() - position)].first);
+            }
+        }
+
+        return line;
+    }
+
+    // A cheapest journey from a stop some route passes, at the time it passes, to a later stop of the route.
+    inline std::string planLine(const std::vector<GeneratedRoute>& routes, std::mt19937_64& random) {
+        const auto& stops = routes[random() % routes.size()];
+        std::size_t position = random() % stops.size();
+        std::size_t end = position + random() % (stops.size() - position);
+        return "?? " + stopName(stops[position].first) + " " + timeToString(stops[position].second) + " "
+            + stopName(stops[end].first);
+    }
+
+    inline std::string invalidLine(std::size_t stopCount, std::mt19937_64& random) {
+        switch (random() % 5) {
+            case 0:
+                return "? " + stopName(random() % stopCount);
+            case 1:
+                return "1 4:59 " + stopName(random() % stopCount);
+            case 2:
+                return "Broken ticket 1.0 10";
+            case 3:
+                return "? " + stopName(random() % stopCount) + " 0 " + stopName(random() % stopCount);
+            default:
+                return "#" + stopName(random() % stopCount);
+        }
+    }
+
+    inline Lines generate(const Params& params) {
+        std::mt19937_64 random(params.at("seed"));
+        Lines lines;
+
+        auto routes = generateRoutes(params, random);
+        std::multimap<std::size_t, std::pair<std::size_t, std::size_t>> routesByStop;
+        for (std::size_t route = 0; route < routes.size(); route ++) {
+            lines.push_back(routeLine(route, routes[route]));
+            for (std::size_t position = 0; position < routes[route].size(); position ++) {
+                routesByStop.insert({routes[route][position].first, {route, position}});
+            }
+        }
+
+        auto ticketLine = [&random](std::size_t ticket) {
+            std::string name = "Ticket " + stopName(ticket).substr(1);
+            // Longer tickets cost more, so that selections vary with the journey's duration.
+            unsigned long long validTime = 1 + random() % 240, price = validTime * (5 + random() % 10) + random() % 100;
+            return name + " " + std::to_string(price / 100) + "." + std::to_string(price % 100 / 10)
+                + std::to_string(price % 10) + " " + std::to_string(validTime);
+        };
+        std::size_t ticketCount = params.at("tickets");
+        for (std::size_t ticket = 0; ticket < ticketCount; ticket ++) {
+            lines.push_back(ticketLine(ticket));
+        }
+        for (std::size_t reprice = 0; reprice < params.at("reprice-tickets"); reprice ++) {
+            lines.push_back("= " + ticketLine(random() % ticketCount));
+        }
+        for (std::size_t removal = 0; removal < params.at("remove-tickets"); removal ++) {
+            lines.push_back("- Ticket " + stopName(ticketCount - 1 - removal).substr(1));
+        }
+
+        for (std::size_t line = 0; line < params.at("lines"); line ++) {
+            auto kind = random() % 100;
+            std::size_t legCount = 1 + random() % params.at("query-legs");
+            if (kind < params.at("valid-percent")) {
+                lines.push_back(queryLine(routes, routesByStop, legCount, false, random));
+            } else if (kind < params.at("valid-percent") + params.at("wait-percent")) {
+                lines.push_back(queryLine(routes, routesByStop, legCount, true, random));
+            } else if (kind < params.at("valid-percent") + params.at("wait-percent") + params.at("plan-percent")) {
+                lines.push_back(planLine(routes, random));
+            } else {
+                lines.push_back(invalidLine(params.at("stops"), random));
+            }
+        }
+
+        return lines;
+    }
+}
+
+#endif // KASA_BENCH_WORKLOAD_H
@@ -1,45 +1,171 @@
+#include "kasa.h"
+
 #include <iostream>
+#include <sstream>
+#include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <list>
+#include <array>
+#include <tuple>
+#include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <set>
+#include <optional>
 #include <variant>
-#include <regex>
+#include <algorithm>
+#include <memory>
+#include <memory_resource>
+#include <charconv>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <cmath>
 #include <climits>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace {
     // Ticket's price.
-    using Price = unsigned long;
+    using Price = kasa::Price;
     // Ticket's validity time.
-    using ValidTime = unsigned long long;
-    // Map of tickets allowing for accessing its price by its name.
-    using TicketMap = std::unordered_map<std::string, Price>;
-    // Map of tickets sorted by price (ascending order).
-    using TicketSortedMap = std::map<std::pair<Price, std::string>, ValidTime>;
+    using ValidTime = kasa::ValidTime;
+    // Ticket's id - its position in the catalog.
+    using TicketId = kasa::TicketId;
+    // Fare class's id - its position among the fare classes.
+    using FareClassId = std::uint32_t;
+    // Catalog of tickets (name, price, validity time, fare class) in order of insertion; references to it stay valid.
+    // Withdrawn tickets stay in it, so that ids never change.
+    using TicketCatalog = std::pmr::deque<std::tuple<std::pmr::string, Price, ValidTime, FareClassId>>;
+    // Map of tickets allowing for accessing a ticket's id by its name (pointing into the catalog). Removed tickets
+    // map to withdrawnTicketId, so that their entries are not allocated anew when the name is added again.
+    using TicketMap = std::pmr::unordered_map<std::string_view, TicketId>;
+    // Id a removed ticket's name maps to.
+    constexpr TicketId withdrawnTicketId = UINT32_MAX;
     // Tram's arrival time at a stop.
-    using StopTime = unsigned long;
-    // Map of stops in a given route.
-    using Route = std::unordered_map<std::string, StopTime>;
+    using StopTime = kasa::StopTime;
+    // Service window - the first and the last minute trams run at.
+    using ServiceWindow = std::pair<StopTime, StopTime>;
+    // Trams run from 5:55 to 21:21, unless configured otherwise.
+    constexpr ServiceWindow defaultServiceWindow = {kasa::defaultServiceStart, kasa::defaultServiceEnd};
+    // Latest time a service may run at - trips past midnight go on counting minutes, as in GTFS.
+    constexpr StopTime maxStopTime = kasa::maxStopTime;
+    // Longest possible journey of the default window.
+    constexpr StopTime defaultMaxTravelTime = kasa::defaultServiceEnd - kasa::defaultServiceStart;
+    // Maximal number of tickets in a set, unless configured otherwise.
+    constexpr std::size_t defaultTicketLimit = kasa::defaultTicketLimit;
+    // Highest configurable number of tickets in a set.
+    constexpr std::size_t maxTicketCount = kasa::maxTicketCount;
+    // Collective price of a set of tickets.
+    using SetPrice = unsigned long long;
+    // Tickets making up a set - their number and ids (ordered by price).
+    using TicketIds = std::pair<std::size_t, std::array<TicketId, maxTicketCount>>;
+    // A set of tickets along with its collective price.
+    using TicketSet = std::pair<SetPrice, TicketIds>;
+    // A set without any tickets.
+    const TicketSet emptyTicketSet = {0, {0, {}}};
+    // Placeholder for a set that does not exist (yet).
+    const TicketSet noTicketSet = {ULLONG_MAX, {0, {}}};
+    // Cheapest sets of a given size, indexed by their collective validity time (capped at the covered time limit).
+    using TicketSetsByTime = std::vector<TicketSet>;
+    // Cheapest sets of every size up to the ticket limit (k-th layer holds sets of k + 1 tickets).
+    using TicketLayers = std::vector<TicketSetsByTime>;
+    // Cheapest set of at most as many tickets as there are layers for every journey duration.
+    using CheapestTicketSets = std::vector<TicketSet>;
+    // Table of the cheapest ticket sets, updated with every added ticket so a query needs a single lookup. It is
+    // sized for the longest journey of the service window.
+    using TicketSelectionTable = std::pair<TicketLayers, CheapestTicketSets>;
+    // Current tickets by their covered time, cheapest (and then earliest added) first. Only the first ticket of a
+    // covered time can be part of a cheapest set, so the others are not looked at until it is withdrawn.
+    using TicketsByCoveredTime = std::map<std::size_t, std::vector<TicketId>>;
+    // A fare class (tariff) - its tag (empty for untagged tickets), its tickets by name, the table of the cheapest
+    // sets of its tickets and the tickets by covered time. Tickets of different classes are never combined.
+    using FareClass = std::tuple<std::pmr::string, TicketMap, TicketSelectionTable, TicketsByCoveredTime>;
+    // Fare classes in order of their first ticket, except for the untagged class, which always exists and comes first.
+    // References to them stay valid.
+    using FareClasses = std::pmr::deque<FareClass>;
+    // Stop's id - its position in the stop index.
+    using StopId = kasa::StopId;
+    // Id of a stop name that does not appear in any route.
+    constexpr StopId noStopId = kasa::noStopId;
+    // Interned stop names - names by id (references to them stay valid) and ids by name.
+    using StopIndex = std::pair<std::pmr::deque<std::pmr::string>, std::pmr::unordered_map<std::string_view, StopId>>;
+    // Arrival time as stored in a route - fits any time of the day.
+    using RouteStopTime = std::uint16_t;
+    // Stops of a given route along with arrival times, sorted by stop id.
+    using Route = std::pmr::vector<std::pair<StopId, RouteStopTime>>;
     // Line number (id).
-    using LineNum = unsigned long long;
-    // Map of routes.
-    using Timetable = std::unordered_map<LineNum, Route>;
+    using LineNum = kasa::LineNum;
+    // Open addressing slots of the timetable, with linear probing; a slot with an empty route is free.
+    using TimetableSlots = std::pmr::vector<std::pair<LineNum, Route>>;
+    // Map of routes - number of routes and their slots (a power of two, at most half of them taken).
+    using Timetable = std::pair<std::size_t, TimetableSlots>;
+    // Visit of a route at a stop, packed as the stop id and the time.
+    using StopVisitKey = std::uint64_t;
+    // Lines by the stop visits they make. Connections have to be exact, so a passenger at a stop at a given time
+    // may board just these lines.
+    using StopVisits = std::pmr::unordered_multimap<StopVisitKey, LineNum>;
+    // Version of the ticket catalog, changing with every change to it.
+    using TicketEpoch = std::size_t;
+    // Everything accepted from the input so far - stops, routes, tickets, their fare classes, stop visits and the
+    // ticket epoch - along with the service window. Its containers allocate from the network's arena, which only
+    // grows, as nothing but the names of withdrawn tickets is ever removed from the network.
+    using Network = std::tuple<StopIndex, Timetable, TicketCatalog, FareClasses, StopVisits, TicketEpoch,
+        ServiceWindow>;
     // A request to add a route to the timetable.
     using AddRoute = std::pair<LineNum, Route>;
-    // A request to add a ticket to the collection.
-    using AddTicket = std::pair<std::string, std::pair<Price, ValidTime>>;
-    // A stop requested by passenger on a given line.
-    using QueryStop = std::pair<std::string, LineNum>;
+    // A request to add a ticket to the collection - name, price, validity time and fare class (empty if untagged).
+    // A request to reprice a ticket takes the same form, with its new price and validity time.
+    using AddTicket = std::tuple<std::pmr::string, Price, ValidTime, std::pmr::string>;
+    // A request to withdraw a ticket - name and fare class (empty if untagged).
+    using RemoveTicket = std::pair<std::pmr::string, std::pmr::string>;
+    // A stop requested by passenger on a given line - name (pointing into the input line), line and stop id.
+    using QueryStop = std::tuple<std::string_view, LineNum, StopId>;
     // A vector of all stops requested by passenger.
-    using Query = std::vector<QueryStop>;
-    // Variant allowing for keeping every valid request.
-    using Request = std::variant<AddRoute, AddTicket, Query>;
+    using Query = std::pmr::vector<QueryStop>;
+    // What makes a planned journey the best one.
+    enum PlanCriterion {
+        CHEAPEST,
+        FEWEST_RIDES
+    };
+    // A request to plan a journey - criterion, origin, departure time and destination.
+    using Plan = std::tuple<PlanCriterion, StopId, StopTime, StopId>;
+    // Stops of a route as written - names (pointing into the input line) along with arrival times.
+    using RouteStopNames = std::pmr::vector<std::pair<std::string_view, StopTime>>;
+    // A request to add a route, scanned but not resolved yet - line number and stops as written.
+    using ScannedRoute = std::pair<LineNum, RouteStopNames>;
+    // A request to plan a journey, scanned but not resolved yet - criterion, origin name, departure time and
+    // destination name.
+    using ScannedPlan = std::tuple<PlanCriterion, std::string_view, StopTime, std::string_view>;
+    // Variant allowing for keeping every valid request, both scanned and resolved.
+    using Request = std::variant<AddRoute, AddTicket, RemoveTicket, Query, Plan, ScannedRoute, ScannedPlan>;
     // Type of request (both valid or invalid).
     enum RequestType {
         ADD_ROUTE,
         ADD_TICKET,
+        REMOVE_TICKET,
+        REPRICE_TICKET,
         QUERY,
+        PLAN,
         IGNORE,
         ERROR_REQ
     };
@@ -52,50 +178,253 @@ namespace {
         TRAVEL_TIME_ERR
     };
     // Variant allowing for keeping additional info for a response to query.
-    using TravelTimeInfo = std::variant<StopTime, std::string>;
+    using TravelTimeInfo = std::variant<StopTime, std::string_view>;
     // A travel time counting result - type of travel time counting result and additional info (if valid result).
     using TravelTimeCountingResult = std::pair<TravelTimeResultType, std::optional<TravelTimeInfo>>;
     // A section's validity check result - type of travel time counting result and start time/stop time (if valid).
     using SectionCheckResult = std::pair<TravelTimeResultType, std::optional<std::pair<StopTime, StopTime>>>;
-    // A vector of tickets selected for a journey.
-    using SelectedTickets = std::vector<std::string>;
-    // Ticket iterator, used for iterating over a ticket map.
-    using TicketIterator = std::_Rb_tree_const_iterator<std::pair<const std::pair<Price, std::string>, unsigned long long>>;
-    // Up to date information (collective price, collective time) in a given iteration.
-    using TicketIteratingInfo = std::pair<unsigned long long, ValidTime>;
-    // Status of a given set of tickets in regard to the current best set.
-    enum TicketStatus {
-        NEW_BEST,
-        TOO_EXPENSIVE,
-        TOO_SHORT
-    };
-    // A ticket selection result - ticket set's status and the information about it.
-    using TicketSelectionResult = std::pair<TicketStatus, TicketIteratingInfo>;
+    // A vector of tickets selected for a journey - their names (pointing into the catalog) along with their ids.
+    using SelectedTickets = std::pmr::vector<std::pair<std::string_view, TicketId>>;
+    // Step of a journey search reaching a stop visit - number of rides taken, and the visit and line it came from.
+    using JourneyStep = std::tuple<std::size_t, StopVisitKey, LineNum>;
+    // Stop visits reached by a journey search, along with the way they were first reached.
+    using JourneySteps = std::pmr::unordered_map<StopVisitKey, JourneyStep>;
+    // Earliest time every line was boarded at during a journey search.
+    using BoardingTimes = std::pmr::unordered_map<LineNum, StopTime>;
+    // A planned journey - its stops in the form of a query (names pointing into the stop index) and its tickets.
+    using PlannedJourney = std::pair<Query, SelectedTickets>;
+    // Tickets selected for a journey in every fare class that has a set for it - fare class (pointing into the
+    // network) along with its tickets.
+    using FareTickets = std::pmr::vector<std::pair<std::string_view, SelectedTickets>>;
     // Type of a response to a request (both valid or invalid).
     enum ResponseType {
         FOUND,
+        FOUND_FARES,
+        PLANNED,
         WAIT,
         NOT_FOUND,
         NO_RESPONSE,
         ERROR_RESP
     };
     // Variant allowing for containing a response to a valid request.
-    using Response = std::variant<std::string, std::vector<std::string>>;
+    using Response = std::variant<std::string_view, SelectedTickets, PlannedJourney, FareTickets>;
     // A processing result - type of response and a response itself (if request was valid).
     using ProcessResult = std::pair<ResponseType, std::optional<Response>>;
+    // Identity of a query for caching - its line, as the grammar leaves no two ways of writing the same query
+    // apart from leading zeros of line numbers.
+    using QueryKey = std::string;
+    // Result of a query along with the ticket epoch it was computed in.
+    using CachedQueryResult = std::pair<TicketEpoch, ProcessResult>;
+    // Cached query results from the most to the least recently used.
+    using QueryCacheEntries = std::list<std::pair<QueryKey, CachedQueryResult>>;
+    // Cache of query results - entries, their index by key (pointing into the entries), capacity, and numbers of
+    // hits and misses.
+    using QueryCache = std::tuple<QueryCacheEntries, std::unordered_map<std::string_view, QueryCacheEntries::iterator>,
+        std::size_t, std::uint64_t, std::uint64_t>;
+    // Number of queries cached by every worker, unless configured otherwise. A miss costs about as much as
+    // answering the query, so caching is left for inputs known to repeat their queries.
+    constexpr std::size_t defaultQueryCacheCapacity = 0;
+    // Output streams of the program.
+    enum OutputStream {
+        STDOUT,
+        STDERR
+    };
+    // Buffered output to a stream - the stream and formatted bytes not yet written to it.
+    using OutputChannel = std::pair<std::ostream*, std::string>;
+    // Output of the program - channels of both streams, whether every response is flushed right away, and the tag
+    // every response line starts with (empty but for the named networks of a sharded run).
+    using Output = std::tuple<std::array<OutputChannel, 2>, bool, std::string_view>;
+    // Amount of buffered bytes that makes a channel flush.
+    constexpr std::size_t outputFlushThreshold = 1 << 16;
+    // Command line options by name, along with their (possibly empty) values.
+    using Options = std::unordered_map<std::string_view, std::string_view>;
+    // Names of the accepted command line options.
+    const std::unordered_set<std::string_view> knownOptions = {
+        "line-buffered",
+        "stream-input",
+        "threads",
+        "profile-fd",
+        "load-snapshot",
+        "save-snapshot",
+        "max-tickets",
+        "query-cache",
+        "socket",
+        "pipeline",
+        "journal",
+        "journal-sync-ms",
+        "stats-fd",
+        "stats-top",
+        "import-stop-times",
+        "service-window",
+        "networks",
+        "network-output"
+    };
+    // Options a sharded run does not take - each of them is about a single network.
+    const std::array<std::string_view, 10> unshardedOptions = {
+        "load-snapshot",
+        "save-snapshot",
+        "socket",
+        "pipeline",
+        "journal",
+        "journal-sync-ms",
+        "profile-fd",
+        "stats-fd",
+        "stats-top",
+        "import-stop-times"
+    };
+    // States of a client's connection to the server.
+    enum ConnectionState {
+        CONNECTION_OPEN,
+        CONNECTION_INPUT_CLOSED,
+        CONNECTION_FINISHED,
+        CONNECTION_FAILED
+    };
+    // Client of the server - its socket, received bytes not yet handled, responses not yet sent, the stream its
+    // output formats responses into, the output, number of its next line, number of tickets proposed to it, and
+    // the connection's state.
+    using Connection = std::tuple<int, std::string, std::string, std::unique_ptr<std::ostringstream>, Output,
+        unsigned int, unsigned int, ConnectionState>;
+    // Amount of unsent responses that makes the server stop reading requests of a client.
+    constexpr std::size_t connectionOutputLimit = 1 << 24;
+    // Maximal number of bytes read from a client in a round of the server, so that a client sending a lot cannot hold
+    // up the others; the rest waits in its socket for the next round.
+    constexpr std::size_t connectionInputLimit = 1 << 16;
+    // Maximal number of events taken from epoll at once.
+    constexpr int maxServerEvents = 64;
+    // Function finding the first newline in a range of characters (or the range's end).
+    using NewlineFinder = const char* (*)(const char*, const char*);
+    // Memory mapped input - the whole mapping and the part of it left to read.
+    using MappedInput = std::pair<std::string_view, std::string_view>;
+    // Lines handed over from the input at once.
+    using InputBatch = std::vector<std::string_view>;
+    // Maximal number of lines in a batch of a mapped input.
+    constexpr std::size_t inputBatchSize = 1 << 12;
+    // Number of bytes requested by a single read of a streamed input.
+    constexpr std::size_t inputChunkSize = 1 << 20;
+    // Queries are evaluated in parallel only if every worker gets at least that many of them.
+    constexpr std::size_t minQueriesPerWorker = 64;
+    // Arena of a worker for requests and responses of a batch, released once the batch is printed - its initial
+    // buffer and the arena itself (neither of them ever moves).
+    using ScratchArena = std::pair<std::unique_ptr<char[]>, std::unique_ptr<std::pmr::monotonic_buffer_resource>>;
+    // Size of the initial buffer of a scratch arena, enough for a batch of typical lines.
+    constexpr std::size_t scratchArenaSize = 1 << 20;
+    // Size of the buffer a journey search starts with, on the stack - enough for a search over a typical network.
+    constexpr std::size_t searchArenaSize = 1 << 16;
+    // Batch of lines passed along the pipeline - its own copy of the lines, the lines (pointing into it), their
+    // parse and process results, and the arena both of them are allocated in.
+    using PipelineBatch = std::tuple<std::string, InputBatch, std::vector<ParseResult>, std::vector<ProcessResult>,
+        ScratchArena>;
+    // Bounded lock-free queue of batches from one thread to another - slots (a power of two) and numbers of batches
+    // pushed and popped so far. A null batch marks the end of the input.
+    template<typename Batch>
+    using LockFreeQueue = std::tuple<std::vector<Batch*>, std::atomic<std::size_t>, std::atomic<std::size_t>>;
+    // Queue of batches from one pipeline thread to another.
+    using BatchQueue = LockFreeQueue<PipelineBatch>;
+    // Number of batches passed along the pipeline at once.
+    constexpr std::size_t pipelineBatchCount = 16;
+    // Number of slots of a batch queue - every batch and the end marker fit in, so a push never actually waits.
+    constexpr std::size_t batchQueueSize = 32;
+    // Number of parser threads of the pipeline, unless configured otherwise.
+    constexpr unsigned int defaultParserCount = 2;
+    // Number of batches of every shard passed along at once - fewer than the pipeline's, as every network of a
+    // sharded run has batches of its own.
+    constexpr std::size_t shardBatchCount = 8;
+    // Shards of a sharded run by the names of their networks; shard 0 handles the default network, of untagged lines.
+    using ShardIndex = std::unordered_map<std::string_view, std::size_t>;
+    // Shards the lines of an input batch went to, in input order.
+    using ShardRouting = std::vector<std::size_t>;
+    // Queue of routings from the reader of a sharded run to its writer.
+    using RoutingQueue = LockFreeQueue<ShardRouting>;
+    // Numbers of lines read and tickets proposed before a snapshot was taken.
+    using SnapshotCounters = std::pair<unsigned int, unsigned int>;
+    // Marks the beginning of a snapshot.
+    constexpr std::string_view snapshotMagic = "KASASNAP";
+    // Version of the snapshot format, changed whenever the layout changes.
+    constexpr std::uint32_t snapshotVersion = 5;
+    // Clock used for profiling.
+    using Clock = std::chrono::steady_clock;
+    // Number of request types.
+    constexpr std::size_t requestTypeCount = ERROR_REQ + 1;
+    // Phases of handling a line.
+    enum Phase {
+        PHASE_PARSE,
+        PHASE_PROCESS,
+        PHASE_PRINT
+    };
+    // Number of phases.
+    constexpr std::size_t phaseCount = PHASE_PRINT + 1;
+    // Number of buckets of a latency histogram per power of two.
+    constexpr std::size_t histogramSubBucketCount = 16;
+    // Number of buckets of a latency histogram, enough for any 64-bit number of nanoseconds.
+    constexpr std::size_t histogramBucketCount = histogramSubBucketCount * 61;
+    // Counts of latencies (in nanoseconds) in log-linear buckets.
+    using LatencyHistogram = std::array<std::uint64_t, histogramBucketCount>;
+    // Profile of a run - number of lines and latency histogram by request type, and total time by phase.
+    using Profile = std::tuple<std::array<std::uint64_t, requestTypeCount>,
+        std::array<LatencyHistogram, requestTypeCount>, std::array<std::uint64_t, phaseCount>>;
+    // Hot spots of the queries answered by a worker - number of queries by stop id, rides by line, selections by
+    // ticket id and waits by stop id (of the stop where a passenger would have to wait).
+    using HotspotStats = std::tuple<std::vector<std::uint64_t>, std::unordered_map<LineNum, std::uint64_t>,
+        std::vector<std::uint64_t>, std::vector<std::uint64_t>>;
+    // Collector of hot spot statistics - statistics of every worker (merged only for a report), descriptor the
+    // reports are written to and number of entries of each list of a report.
+    using StatsCollector = std::tuple<std::vector<HotspotStats>, int, std::size_t>;
+    // Number of entries of each list of a statistics report, unless configured otherwise.
+    constexpr std::size_t defaultStatsTopCount = 10;
+    // Ids along with their counts, as listed in a statistics report.
+    using StatsEntries = std::vector<std::pair<std::uint64_t, std::uint64_t>>;
+    // Run of queries between two additions - the batch, the network as of the run, the results, and the query
+    // caches, scratch arenas and statistics of the workers.
+    using QueryRun = std::tuple<const InputBatch&, const Network&, std::vector<ProcessResult>&,
+        std::vector<QueryCache>&, std::vector<ScratchArena>&, StatsCollector*>;
+    // Part of a run handed to a query worker - the run, the range of its lines, the worker's profile and the number of
+    // tickets the worker proposed.
+    using QueryTask = std::tuple<const QueryRun*, std::size_t, std::size_t, Profile*, unsigned int>;
+    // Queue of tasks to a query worker, or back from it.
+    using TaskQueue = LockFreeQueue<QueryTask>;
+    // Query workers started once for all runs, besides the thread handling the batches (worker 0) - queues of tasks
+    // to every worker and back, the task of every worker and the threads.
+    using QueryWorkerPool = std::tuple<std::deque<TaskQueue>, std::deque<TaskQueue>, std::vector<QueryTask>,
+        std::vector<std::thread>>;
+    // Query workers, stopped along with the handle.
+    using QueryWorkers = std::unique_ptr<QueryWorkerPool, void (*)(QueryWorkerPool*)>;
+    // Journal of the routes and tickets accepted so far, for resuming an interrupted run - its file, records not
+    // written yet, time of the last sync, interval between syncs, and whether every write has succeeded.
+    using Journal = std::tuple<int, std::string, Clock::time_point, Clock::duration, bool>;
+    // First line of a journal, changed whenever the format changes.
+    constexpr std::string_view journalHeader = "KASAJOURNAL 1\n";
+    // Amount of records not written yet that makes the journal write them (without syncing).
+    constexpr std::size_t journalWriteThreshold = 1 << 16;
+    // Interval between syncs of the journal, unless configured otherwise.
+    constexpr std::chrono::milliseconds defaultJournalSyncInterval(1000);
+    // A row of a stop_times file - trip (taken for the line number), stop sequence, arrival time and stop name
+    // (pointing into the file). Rows sort into trips, with stops in order of their sequence.
+    using StopTimesRow = std::tuple<LineNum, unsigned long long, StopTime, std::string_view>;
+    // Positions of the trip, arrival time, stop and stop sequence columns of a stop_times file.
+    using StopTimesColumns = std::array<std::size_t, 4>;
+    // Names of the columns read from a stop_times file, in the order of their positions.
+    constexpr std::array<std::string_view, 4> stopTimesColumnNames = {
+        "trip_id", "arrival_time", "stop_id", "stop_sequence"
+    };
+    // Set by SIGUSR1 to ask for a statistics report, written once the batch being handled is done.
+    volatile std::sig_atomic_t isStatsReportRequested = 0;
 
-    RequestType getRequestType(const std::string& line) {
+    RequestType getRequestType(std::string_view line) {
         if (line.empty()) {
             return IGNORE;
         }
-        char c = line.at(0);
+        char c = line.front();
 
         if (isdigit(c)) {
             return ADD_ROUTE;
         } else if (isalpha(c) || isspace(c)) {
             return ADD_TICKET;
+        } else if (c == '-') {
+            return REMOVE_TICKET;
+        } else if (c == '=') {
+            return REPRICE_TICKET;
         } else if (c == '?') {
-            return QUERY;
+            return (line.size() > 1 && (line[1] == '?' || line[1] == '#')) ? PLAN : QUERY;
         } else {
             return ERROR_REQ;
         }
@@ -109,184 +438,397 @@ namespace {
         return ParseResult(ERROR_REQ, std::nullopt);
     }
 
-    inline bool isStopTimeCorrect(StopTime stopTime, StopTime prevStopTime) {
-        static const int minutesLowerBound = 355, minutesUpperBound = 1281;
-        return (stopTime > prevStopTime && stopTime >= minutesLowerBound && stopTime <= minutesUpperBound);
+    inline bool isDigitChar(char c) {
+        return (c >= '0' && c <= '9');
+    }
+
+    inline bool isLetterChar(char c) {
+        return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'));
+    }
+
+    inline bool isStopNameChar(char c) {
+        return (isLetterChar(c) || c == '^' || c == '_');
+    }
+
+    inline bool isTicketNameChar(char c) {
+        return (isLetterChar(c) || c == ' ');
+    }
+
+    // Consumes the given character at the scanning position, if present.
+    inline bool scanChar(std::string_view line, std::size_t& pos, char c) {
+        if (pos < line.size() && line[pos] == c) {
+            pos ++;
+            return true;
+        }
+        return false;
+    }
+
+    // Consumes the longest (possibly empty) run of characters satisfying the predicate.
+    template<typename CharPredicate>
+    inline std::string_view scanWhile(std::string_view line, std::size_t& pos, CharPredicate predicate) {
+        std::size_t begin = pos;
+        while (pos < line.size() && predicate(line[pos])) {
+            pos ++;
+        }
+        return line.substr(begin, pos - begin);
+    }
+
+    // Converts a string of decimal digits, failing on empty input and on overflow just as std::stoull does.
+    inline std::optional<unsigned long long> getNumber(std::string_view digits) {
+        if (digits.empty()) {
+            return std::nullopt;
+        }
+
+        unsigned long long number = 0;
+
+        for (char c : digits) {
+            unsigned long long digit = c - '0';
+            if (number > (ULLONG_MAX - digit) / 10) {
+                return std::nullopt;
+            }
+            number = 10 * number + digit;
+        }
+
+        return number;
+    }
+
+    inline bool isInServiceWindow(StopTime stopTime, const ServiceWindow& serviceWindow) {
+        return (stopTime >= serviceWindow.first && stopTime <= serviceWindow.second);
+    }
+
+    // Stops of a route are visited at strictly increasing times, all within the service window.
+    inline bool isStopTimeCorrect(StopTime stopTime, std::optional<StopTime> prevStopTime,
+            const ServiceWindow& serviceWindow) {
+        return ((! prevStopTime.has_value() || stopTime > prevStopTime.value())
+                && isInServiceWindow(stopTime, serviceWindow));
+    }
+
+    // Accepts one or two digits without a leading zero - whether the hour is one of the service window's is up to
+    // the caller.
+    inline bool isHourCorrect(std::string_view strHour) {
+        return (! strHour.empty() && strHour.size() <= 2 && (strHour.size() == 1 || strHour[0] != '0'));
+    }
+
+    // Scans "h:mm" at the scanning position.
+    std::optional<StopTime> scanClockTime(std::string_view line, std::size_t& pos) {
+        std::string_view strHour = scanWhile(line, pos, isDigitChar);
+        if (! isHourCorrect(strHour) || ! scanChar(line, pos, ':')) {
+            return std::nullopt;
+        }
+
+        std::string_view strMinute = scanWhile(line, pos, isDigitChar);
+        if (strMinute.size() != 2 || strMinute[0] > '5') {
+            return std::nullopt;
+        }
+
+        return 60 * getNumber(strHour).value() + getNumber(strMinute).value();
     }
 
-    inline bool isStopRepeated(const std::string& stopName, const Route& route) {
-        return (route.find(stopName) != route.end());
+    // Scans " h:mm" at the scanning position.
+    inline std::optional<StopTime> scanRouteStopTime(std::string_view line, std::size_t& pos) {
+        if (! scanChar(line, pos, ' ')) {
+            return std::nullopt;
+        }
+        return scanClockTime(line, pos);
     }
 
-    inline std::optional<StopTime> getRouteStopTime(const std::string& strHour, const std::string& strMinute) {
-        try {
-            return 60 * stoul(strHour) + stoul(strMinute);
-        } catch (std::exception& e) {
+    // Scans " name" at the scanning position.
+    std::optional<std::string_view> scanStopName(std::string_view line, std::size_t& pos) {
+        if (! scanChar(line, pos, ' ')) {
+            return std::nullopt;
+        }
+
+        std::string_view stopName = scanWhile(line, pos, isStopNameChar);
+        if (stopName.empty()) {
             return std::nullopt;
         }
+        return stopName;
+    }
+
+    StopId internStop(std::string_view stopName, StopIndex& stopIndex) {
+        auto& [names, ids] = stopIndex;
+
+        auto it = ids.find(stopName);
+        if (it != ids.end()) {
+            return it->second;
+        }
+
+        auto id = static_cast<StopId>(names.size());
+        names.emplace_back(stopName);
+        ids.insert({names.back(), id});
+        return id;
+    }
+
+    inline StopId findStop(std::string_view stopName, const StopIndex& stopIndex) {
+        auto it = stopIndex.second.find(stopName);
+        return (it != stopIndex.second.end()) ? it->second : noStopId;
     }
 
-    std::optional<Route> parseRouteStops(const std::string& str, const std::string& rgxHour,
-            const std::string& rgxMinute, const std::string& rgxStopName) {
-        static const size_t rgxHourGroupPos = 1, rgxMinuteGroupPos = 2, rgxStopNameGroupPos = 3;
-        Route route;
-        StopTime prevStopTime = 0;
+    // Tells repeated stops by their names, so that a rejected route interns none of them.
+    bool isStopNameRepeated(const RouteStopNames& stopNames) {
+        std::pmr::vector<std::string_view> sortedNames(stopNames.size(), stopNames.get_allocator().resource());
+        std::transform(stopNames.begin(), stopNames.end(), sortedNames.begin(),
+                [](const auto& stop) { return stop.first; });
+        std::sort(sortedNames.begin(), sortedNames.end());
+        return (std::adjacent_find(sortedNames.begin(), sortedNames.end()) != sortedNames.end());
+    }
 
-        std::regex rgx(" (" + rgxHour + "):(" + rgxMinute + ") (" + rgxStopName + ")");
-        for (auto it = std::sregex_iterator(str.begin(), str.end(), rgx); it != std::sregex_iterator(); ++ it) {
-            std::smatch match = *it;
+    // Scans stops of a route without touching the stop index, so that any number of lines may be scanned at once.
+    std::optional<RouteStopNames> scanRouteStops(std::string_view line, std::size_t pos,
+            const ServiceWindow& serviceWindow, std::pmr::memory_resource* scratch) {
+        RouteStopNames stopNames(scratch);
+        std::optional<StopTime> prevStopTime;
 
-            const std::string& stopName = match.str(rgxStopNameGroupPos);
-            if (isStopRepeated(stopName, route)) {
+        do {
+            auto stopTime = scanRouteStopTime(line, pos);
+            auto stopName = scanStopName(line, pos);
+            if (! stopTime.has_value() || ! stopName.has_value()) {
                 return std::nullopt;
             }
 
-            auto stopTime = getRouteStopTime(match.str(rgxHourGroupPos), match.str(rgxMinuteGroupPos));
-            if (! stopTime.has_value() || ! isStopTimeCorrect(stopTime.value(), prevStopTime)) {
+            if (! isStopTimeCorrect(stopTime.value(), prevStopTime, serviceWindow)) {
                 return std::nullopt;
             }
 
-            route.insert({stopName, stopTime.value()});
+            stopNames.emplace_back(stopName.value(), stopTime.value());
             prevStopTime = stopTime.value();
+        } while (pos < line.size());
+
+        return stopNames;
+    }
+
+    // Interns the stops of a scanned route, in the order they are visited, and sorts them by stop. The route has to
+    // be accepted already - a stop interned for nothing would be found by plans with no route visiting it.
+    Route internRouteStops(const RouteStopNames& stopNames, StopIndex& stopIndex) {
+        Route route(stopNames.get_allocator().resource());
+
+        route.reserve(stopNames.size());
+        for (const auto& [stopName, stopTime] : stopNames) {
+            route.emplace_back(internStop(stopName, stopIndex), stopTime);
         }
 
+        std::sort(route.begin(), route.end());
         return route;
     }
 
-    ParseResult parseAddRoute(const std::string& line) {
-        static const std::string rgxLineNum = R"(\d+)", rgxHour = R"([5-9]|1\d|2[0-1])", rgxMinute = R"([0-5]\d)",
-            rgxStopName = R"([a-zA-Z^_]+)";
-        static const size_t rgxLineGroupPos = 1, rgxIterGroupPos = 2;
+    ParseResult scanAddRoute(std::string_view line, const ServiceWindow& serviceWindow,
+            std::pmr::memory_resource* scratch) {
+        std::size_t pos = 0;
 
-        std::regex rgx("^(" + rgxLineNum + ")((?: (?:" + rgxHour + "):" + rgxMinute + " " + rgxStopName + ")+)$");
-        std::smatch match;
-
-        if (! std::regex_match(line, match, rgx)) {
+        auto lineNum = getNumber(scanWhile(line, pos, isDigitChar));
+        if (! lineNum.has_value()) {
             return parseError();
         }
 
-        LineNum lineNum = stoull(match.str(rgxLineGroupPos));
-
-        auto route = parseRouteStops(match.str(rgxIterGroupPos), rgxHour, rgxMinute, rgxStopName);
-        if (! route.has_value()) {
+        auto stopNames = scanRouteStops(line, pos, serviceWindow, scratch);
+        if (! stopNames.has_value()) {
             return parseError();
         }
 
-        return ParseResult(ADD_ROUTE, AddRoute(lineNum, route.value()));
+        return ParseResult(ADD_ROUTE, ScannedRoute(lineNum.value(), std::move(stopNames.value())));
     }
 
     inline bool isPriceCorrect(Price price) {
         return (price > 0.00);
     }
 
-    inline std::optional<Price> getFullPrice(const std::string& strIntegerPart, const std::string& strDecimalPart) {
-        try {
-            return 100 * std::stoul(strIntegerPart) + std::stoul(strDecimalPart);
-        } catch (std::exception& e) {
+    // Scans "integer.dd" at the scanning position, failing on the same overflow std::stoul does.
+    std::optional<Price> scanTicketPrice(std::string_view line, std::size_t& pos) {
+        std::string_view strIntegerPart = scanWhile(line, pos, isDigitChar);
+        if (strIntegerPart.empty() || ! scanChar(line, pos, '.')) {
             return std::nullopt;
         }
+
+        std::string_view strDecimalPart = scanWhile(line, pos, isDigitChar);
+        if (strDecimalPart.size() != 2) {
+            return std::nullopt;
+        }
+
+        auto integerPart = getNumber(strIntegerPart);
+        if (! integerPart.has_value() || integerPart.value() > ULONG_MAX) {
+            return std::nullopt;
+        }
+        return 100 * static_cast<Price>(integerPart.value()) + getNumber(strDecimalPart).value();
     }
 
-    inline std::optional<ValidTime> getTicketTime(const std::string& strTime) {
-        try {
-            return std::stoull(strTime);
-        } catch (std::exception& e) {
+    // Scans the validity time - a positive number without leading zeros - at the scanning position.
+    std::optional<ValidTime> scanTicketTime(std::string_view line, std::size_t& pos) {
+        std::string_view strTime = scanWhile(line, pos, isDigitChar);
+        if (strTime.empty() || strTime[0] == '0') {
             return std::nullopt;
         }
+        return getNumber(strTime);
     }
 
-    ParseResult parseAddTicket(const std::string& line) {
-        static const std::string rgxTicketName = R"(([a-zA-Z ]+))", rgxTicketPrice = R"((\d+)\.(\d{2}))",
-            rgxTicketTime = R"(([1-9]\d*))";
-        static const size_t rgxTicketNamePos = 1, rgxTicketPriceIntegerPos = 2, rgxTicketPriceDecimalPos = 3,
-            rgxTicketTimePos = 4;
+    ParseResult parseAddTicket(std::string_view line, std::pmr::memory_resource* scratch) {
+        std::size_t pos = 0;
 
-        std::regex rgx("^" + rgxTicketName + " " + rgxTicketPrice + " " + rgxTicketTime + "$");
-        std::smatch match;
+        // The name may contain spaces, so it ends right before the space preceding the price.
+        std::string_view nameWithSeparator = scanWhile(line, pos, isTicketNameChar);
+        if (nameWithSeparator.size() < 2 || nameWithSeparator.back() != ' ') {
+            return parseError();
+        }
+        std::string_view name = nameWithSeparator.substr(0, nameWithSeparator.size() - 1);
 
-        if (! std::regex_match(line, match, rgx)) {
+        auto price = scanTicketPrice(line, pos);
+        if (! price.has_value() || ! isPriceCorrect(price.value()) || ! scanChar(line, pos, ' ')) {
             return parseError();
         }
 
-        std::string name = match.str(rgxTicketNamePos);
+        auto validTime = scanTicketTime(line, pos);
+        if (! validTime.has_value()) {
+            return parseError();
+        }
 
-        auto price = getFullPrice(match.str(rgxTicketPriceIntegerPos), match.str(rgxTicketPriceDecimalPos));
-        if (! price.has_value() || ! isPriceCorrect(price.value())) {
+        // An optional " @tag" puts the ticket in a fare class.
+        std::string_view fareClass;
+        if (scanChar(line, pos, ' ')) {
+            if (! scanChar(line, pos, '@') || (fareClass = scanWhile(line, pos, isLetterChar)).empty()) {
+                return parseError();
+            }
+        }
+        if (pos != line.size()) {
             return parseError();
         }
 
-        auto validTime = getTicketTime(match.str(rgxTicketTimePos));
-        if (! validTime.has_value()) {
+        AddTicket addTicket(std::pmr::string(name, scratch), price.value(), validTime.value(),
+                std::pmr::string(fareClass, scratch));
+        return ParseResult(ADD_TICKET, Request(std::move(addTicket)));
+    }
+
+    // Parses "- name" and "- name @tag". The name may contain spaces, so it ends at the end of the line or right
+    // before the space preceding the tag.
+    ParseResult parseRemoveTicket(std::string_view line, std::pmr::memory_resource* scratch) {
+        std::size_t pos = 0;
+        if (! scanChar(line, pos, '-') || ! scanChar(line, pos, ' ')) {
             return parseError();
         }
 
-        AddTicket addTicket = {name, {price.value(), validTime.value()}};
-        return ParseResult(ADD_TICKET, Request(addTicket));
+        std::string_view name = scanWhile(line, pos, isTicketNameChar);
+        std::string_view fareClass;
+        if (scanChar(line, pos, '@')) {
+            if (name.size() < 2 || name.back() != ' ' || (fareClass = scanWhile(line, pos, isLetterChar)).empty()) {
+                return parseError();
+            }
+            name.remove_suffix(1);
+        }
+        if (name.empty() || pos != line.size()) {
+            return parseError();
+        }
+
+        RemoveTicket removeTicket(std::pmr::string(name, scratch), std::pmr::string(fareClass, scratch));
+        return ParseResult(REMOVE_TICKET, Request(std::move(removeTicket)));
     }
 
-    inline std::optional<StopTime> getQueryStopTime(const std::string& strStopTime) {
-        try {
-            return std::stoul(strStopTime);
-        } catch (std::exception& e) {
-            return std::nullopt;
+    // Parses "= name price validTime [@tag]" - the rest of the line is just like a ticket to add.
+    ParseResult parseRepriceTicket(std::string_view line, std::pmr::memory_resource* scratch) {
+        std::size_t pos = 0;
+        if (! scanChar(line, pos, '=') || ! scanChar(line, pos, ' ')) {
+            return parseError();
+        }
+
+        ParseResult parseResult = parseAddTicket(line.substr(pos), scratch);
+        if (parseResult.first == ADD_TICKET) {
+            parseResult.first = REPRICE_TICKET;
         }
+        return parseResult;
     }
 
-    std::optional<Query> parseQueryStops(const std::string& str, const std::string& rgxStopName,
-            const std::string& rgxStopTime) {
-        static const size_t rgxStopNamePos = 1, rgxStopTimePos = 2;
-        Query query;
+    std::optional<Query> parseQueryStops(std::string_view line, std::size_t pos, std::pmr::memory_resource* scratch) {
+        Query query(scratch);
+
+        while (true) {
+            auto stopName = scanStopName(line, pos);
+            if (! stopName.has_value()) {
+                return std::nullopt;
+            }
 
-        std::regex rgx(" (" + rgxStopName + ") (" + rgxStopTime + ")");
-        for (auto it = std::sregex_iterator(str.begin(), str.end(), rgx);
-             it != std::sregex_iterator(); ++ it) {
-            std::smatch match = *it;
+            if (pos == line.size()) {
+                query.emplace_back(stopName.value(), 0, noStopId);
+                break;
+            }
 
-            std::string name = match.str(rgxStopNamePos);
+            if (! scanChar(line, pos, ' ')) {
+                return std::nullopt;
+            }
 
-            auto stopTime = getQueryStopTime(match.str(rgxStopTimePos));
-            if (! stopTime.has_value()) {
+            auto lineNum = getNumber(scanWhile(line, pos, isDigitChar));
+            if (! lineNum.has_value()) {
                 return std::nullopt;
             }
+            query.emplace_back(stopName.value(), lineNum.value(), noStopId);
+        }
 
-            QueryStop queryStop = {name, stopTime.value()};
-            query.push_back(queryStop);
+        // At least one line has to be taken.
+        if (query.size() < 2) {
+            return std::nullopt;
         }
 
         return query;
     }
 
-    ParseResult parseQuery(const std::string& line) {
-        static const std::string rgxQueryChar = R"(\?)", rgxStopName = R"([a-zA-Z^_]+)", rgxStopTime = R"(\d+)";
-        static const size_t rgxIterStrPos = 1;
+    // Resolves the stop names once, so that counting travel time compares ids only.
+    void resolveQueryStops(Query& query, const StopIndex& stopIndex) {
+        for (auto& [stopName, lineNum, stopId] : query) {
+            stopId = findStop(stopName, stopIndex);
+        }
+    }
 
-        std::regex rgx("^" + rgxQueryChar + "((?: " + rgxStopName + " " + rgxStopTime + ")+) (" + rgxStopName + ")$");
-        std::smatch match;
+    ParseResult scanQuery(std::string_view line, std::pmr::memory_resource* scratch) {
+        std::size_t pos = 0;
 
-        if (! std::regex_match(line, match, rgx)) {
+        if (! scanChar(line, pos, '?')) {
             return parseError();
         }
 
-        auto query = parseQueryStops(match.str(rgxIterStrPos), rgxStopName, rgxStopTime);
+        auto query = parseQueryStops(line, pos, scratch);
         if (! query.has_value()) {
             return parseError();
         }
 
-        size_t rgxLasStopNamePos = match.size() - 1;
-        QueryStop queryStop = {match.str(rgxLasStopNamePos), 0};
-        query.value().push_back(queryStop);
+        return ParseResult(QUERY, std::move(query.value()));
+    }
+
+    // Scans "?? origin H:MM destination" (cheapest journey) and "?# origin H:MM destination" (fewest rides).
+    ParseResult scanPlan(std::string_view line, const ServiceWindow& serviceWindow) {
+        std::size_t pos = 0;
+
+        if (! scanChar(line, pos, '?')) {
+            return parseError();
+        }
+        PlanCriterion criterion = scanChar(line, pos, '#') ? FEWEST_RIDES : CHEAPEST;
+        if (criterion == CHEAPEST && ! scanChar(line, pos, '?')) {
+            return parseError();
+        }
+
+        auto origin = scanStopName(line, pos);
+        auto departureTime = scanRouteStopTime(line, pos);
+        auto destination = scanStopName(line, pos);
+        if (! origin.has_value() || ! departureTime.has_value() || ! destination.has_value() || pos != line.size()
+                || ! isInServiceWindow(departureTime.value(), serviceWindow)) {
+            return parseError();
+        }
 
-        return ParseResult(QUERY, query.value());
+        return ParseResult(PLAN, ScannedPlan(criterion, origin.value(), departureTime.value(), destination.value()));
     }
 
-    ParseResult parseInputLine(const std::string& line) {
+    // Scans a line on its own - requests naming stops are left for resolveRequest. Requests are allocated in the
+    // scratch arena - anything kept in the network is copied out of it.
+    ParseResult scanInputLine(std::string_view line, const ServiceWindow& serviceWindow,
+            std::pmr::memory_resource* scratch) {
         switch (getRequestType(line)) {
             case ADD_ROUTE:
-                return parseAddRoute(line);
+                return scanAddRoute(line, serviceWindow, scratch);
             case ADD_TICKET:
-                return parseAddTicket(line);
+                return parseAddTicket(line, scratch);
+            case REMOVE_TICKET:
+                return parseRemoveTicket(line, scratch);
+            case REPRICE_TICKET:
+                return parseRepriceTicket(line, scratch);
             case QUERY:
-                return parseQuery(line);
+                return scanQuery(line, scratch);
+            case PLAN:
+                return scanPlan(line, serviceWindow);
             case IGNORE:
                 return parseIgnore();
             default:
@@ -296,10 +838,151 @@ namespace {
         return parseError();
     }
 
-    SectionCheckResult checkSection(const std::string& from, const std::string& to, const Route& line,
-            StopTime& arrivalTime) {
-        auto startStop = line.find(from);
-        auto endStop = line.find(to);
+    // Mixes the bits of a line number, so that consecutive numbers spread over the slots.
+    inline std::size_t hashLineNum(LineNum lineNum) {
+        lineNum ^= lineNum >> 33;
+        lineNum *= 0xff51afd7ed558ccdULL;
+        lineNum ^= lineNum >> 33;
+        return static_cast<std::size_t>(lineNum);
+    }
+
+    // Finds the slot holding the line, or the free slot where it belongs.
+    std::size_t findTimetableSlot(const TimetableSlots& slots, LineNum lineNum) {
+        std::size_t mask = slots.size() - 1;
+        std::size_t slot = hashLineNum(lineNum) & mask;
+
+        while (! slots[slot].second.empty() && slots[slot].first != lineNum) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    const Route* findRoute(LineNum lineNum, const Timetable& timetable) {
+        const auto& slots = timetable.second;
+        if (slots.empty()) {
+            return nullptr;
+        }
+
+        const auto& slot = slots[findTimetableSlot(slots, lineNum)];
+        return slot.second.empty() ? nullptr : &slot.second;
+    }
+
+    inline bool isLineRepeated(const LineNum& lineNum, const Timetable& timetable) {
+        return (findRoute(lineNum, timetable) != nullptr);
+    }
+
+    // A route is checked against the timetable before its stops are interned, as it is resolved right before it is
+    // processed.
+    void resolveAddRoute(ParseResult& parseResult, Network& network) {
+        auto& [lineNum, stopNames] = std::get<ScannedRoute>(parseResult.second.value());
+
+        if (isLineRepeated(lineNum, std::get<Timetable>(network)) || isStopNameRepeated(stopNames)) {
+            parseResult = parseError();
+            return;
+        }
+
+        parseResult.second = AddRoute(lineNum, internRouteStops(stopNames, std::get<StopIndex>(network)));
+    }
+
+    // Both ends of a plan have to be known stops.
+    void resolvePlan(ParseResult& parseResult, const StopIndex& stopIndex) {
+        const auto& [criterion, origin, departureTime, destination] = std::get<ScannedPlan>(parseResult.second.value());
+
+        StopId originId = findStop(origin, stopIndex);
+        StopId destinationId = findStop(destination, stopIndex);
+        if (originId == noStopId || destinationId == noStopId || originId == destinationId) {
+            parseResult = parseError();
+            return;
+        }
+
+        parseResult.second = Plan(criterion, originId, departureTime, destinationId);
+    }
+
+    // Turns the stop names of a scanned request into ids. Lines have to be resolved in input order, each right before
+    // it is processed, as routes intern their stops.
+    void resolveRequest(ParseResult& parseResult, Network& network) {
+        switch (parseResult.first) {
+            case ADD_ROUTE:
+                resolveAddRoute(parseResult, network);
+                break;
+            case QUERY:
+                resolveQueryStops(std::get<Query>(parseResult.second.value()), std::get<StopIndex>(network));
+                break;
+            case PLAN:
+                resolvePlan(parseResult, std::get<StopIndex>(network));
+                break;
+            default:
+                break;
+        }
+    }
+
+    ParseResult parseQuery(std::string_view line, const StopIndex& stopIndex, std::pmr::memory_resource* scratch) {
+        ParseResult parseResult = scanQuery(line, scratch);
+
+        if (parseResult.first == QUERY) {
+            resolveQueryStops(std::get<Query>(parseResult.second.value()), stopIndex);
+        }
+
+        return parseResult;
+    }
+
+    ParseResult parsePlan(std::string_view line, const StopIndex& stopIndex, const ServiceWindow& serviceWindow) {
+        ParseResult parseResult = scanPlan(line, serviceWindow);
+
+        if (parseResult.first == PLAN) {
+            resolvePlan(parseResult, stopIndex);
+        }
+
+        return parseResult;
+    }
+
+    ParseResult parseInputLine(std::string_view line, Network& network, std::pmr::memory_resource* scratch) {
+        ParseResult parseResult = scanInputLine(line, std::get<ServiceWindow>(network), scratch);
+        resolveRequest(parseResult, network);
+
+        return parseResult;
+    }
+
+    // Grows the slots (doubling them) until routeCount routes fit in, so that many routes may be inserted without
+    // rehashing in between.
+    void reserveTimetable(Timetable& timetable, std::size_t routeCount) {
+        static const std::size_t initialSlotCount = 16;
+        auto& [count, slots] = timetable;
+
+        std::size_t slotCount = slots.size();
+        while (2 * routeCount > slotCount) {
+            slotCount = std::max(2 * slotCount, initialSlotCount);
+        }
+        if (slotCount == slots.size()) {
+            return;
+        }
+
+        TimetableSlots grown(slotCount, slots.get_allocator());
+        for (auto& slot : slots) {
+            if (! slot.second.empty()) {
+                grown[findTimetableSlot(grown, slot.first)] = std::move(slot);
+            }
+        }
+        slots = std::move(grown);
+    }
+
+    void insertRoute(LineNum lineNum, Route&& route, Timetable& timetable) {
+        auto& [count, slots] = timetable;
+        reserveTimetable(timetable, count + 1);
+
+        // A route from another arena is copied into the timetable's one.
+        slots[findTimetableSlot(slots, lineNum)] = {lineNum, std::move(route)};
+        count ++;
+    }
+
+    inline Route::const_iterator findRouteStop(StopId stopId, const Route& route) {
+        auto it = std::lower_bound(route.begin(), route.end(), std::pair<StopId, RouteStopTime>(stopId, 0));
+        return (it != route.end() && it->first == stopId) ? it : route.end();
+    }
+
+    SectionCheckResult checkSection(StopId from, StopId to, const Route& line, StopTime& arrivalTime) {
+        auto startStop = findRouteStop(from, line);
+        auto endStop = findRouteStop(to, line);
 
         if (startStop == line.end() || endStop == line.end()) {
             return SectionCheckResult(TRAVEL_TIME_ERR, std::nullopt);
@@ -323,15 +1006,14 @@ namespace {
             auto& current = tour[i];
             auto& next = tour[i + 1];
 
-            const auto& currentName = current.first;
-            const auto& nextName = next.first;
+            const auto& currentName = std::get<0>(current);
 
-            const auto& line = timetable.find(current.second);
-            if(line == timetable.end()) {
+            const Route* line = findRoute(std::get<1>(current), timetable);
+            if (line == nullptr) {
                 return TravelTimeCountingResult(TRAVEL_TIME_ERR, std::nullopt);
             }
 
-            auto result = checkSection(currentName, nextName, line->second, arrivalTime);
+            auto result = checkSection(std::get<2>(current), std::get<2>(next), *line, arrivalTime);
             switch (result.first) {
                 case TRAVEL_TIME_WAIT:
                     return TravelTimeCountingResult(TRAVEL_TIME_WAIT, currentName);
@@ -349,267 +1031,3451 @@ namespace {
         return TravelTimeCountingResult(TRAVEL_TIME_FOUND, TravelTimeInfo(endTime - startTime));
     }
 
-    TicketSelectionResult compareTicket(StopTime totalTime, const TicketIterator& it, TicketIteratingInfo info,
-                                        unsigned long long minPrice) {
-        const auto& key = it->first;
-        auto price = key.first;
-        auto time = it->second;
+    inline StopVisitKey getStopVisitKey(StopId stopId, StopTime stopTime) {
+        return (static_cast<StopVisitKey>(stopId) << 16) | stopTime;
+    }
+
+    inline StopId getVisitedStop(StopVisitKey key) {
+        return static_cast<StopId>(key >> 16);
+    }
 
-        unsigned long long currentPrice = info.first + price;
-        ValidTime currentTime = info.second + time;
+    inline StopTime getVisitTime(StopVisitKey key) {
+        return static_cast<StopTime>(key & 0xffff);
+    }
 
-        if (currentTime > totalTime) {
-            if (currentPrice <= minPrice) {
-                return TicketSelectionResult(NEW_BEST, TicketIteratingInfo(currentPrice, currentTime));
-            }
-            return TicketSelectionResult(TOO_EXPENSIVE, TicketIteratingInfo(currentPrice, currentTime));
+    void indexRoute(LineNum lineNum, const Route& route, StopVisits& stopVisits) {
+        for (const auto& [stopId, stopTime] : route) {
+            stopVisits.emplace(getStopVisitKey(stopId, stopTime), lineNum);
         }
-        return TicketSelectionResult(TOO_SHORT, TicketIteratingInfo(currentPrice, currentTime));
     }
 
-    std::pair<bool, bool> updateTicketSelectionLoop(TicketSelectionResult& result) {
-        bool breakLoop = false;
-        bool updateBestTickets = false;
-
-        switch (result.first) {
-            case NEW_BEST:
-                updateBestTickets = true;
-                breakLoop = true;
-                break;
-            case TOO_EXPENSIVE:
-                breakLoop = true;
-                break;
-            case TOO_SHORT:
-                break;
+    // Rides from the stop visit along every line making it, to every later stop of the line. A line already boarded
+    // at an earlier time has reached those stops before, so it is only ridden up to where it was boarded. Lines
+    // are taken in order of their numbers, so that ties are broken the same way however the index was built.
+    void rideFromStopVisit(StopVisitKey from, std::size_t rides, const Network& network, JourneySteps& steps,
+            BoardingTimes& boardingTimes, std::pmr::vector<StopVisitKey>& reached) {
+        StopTime time = getVisitTime(from);
+        auto visits = std::get<StopVisits>(network).equal_range(from);
+        std::pmr::vector<LineNum> lines(steps.get_allocator().resource());
+        for (auto it = visits.first; it != visits.second; it ++) {
+            lines.push_back(it->second);
         }
+        std::sort(lines.begin(), lines.end());
+
+        for (LineNum lineNum : lines) {
+            auto [boarding, unboarded] = boardingTimes.try_emplace(lineNum, time);
+            StopTime boardedTime = unboarded ? maxStopTime + 1 : boarding->second;
+            if (time >= boardedTime) {
+                continue;
+            }
+            boarding->second = time;
+
+            for (const auto& [stopId, stopTime] : *findRoute(lineNum, std::get<Timetable>(network))) {
+                if (stopTime <= time || stopTime >= boardedTime) {
+                    continue;
+                }
 
-        return {updateBestTickets, breakLoop};
+                StopVisitKey to = getStopVisitKey(stopId, stopTime);
+                if (steps.try_emplace(to, rides, from, lineNum).second) {
+                    reached.push_back(to);
+                }
+            }
+        }
     }
 
-    void select3rdTicket(const TicketSortedMap& tickets, StopTime totalTime, SelectedTickets& bestTickets,
-            unsigned long long& minPrice, const TicketIterator& it, const TicketIteratingInfo& prev,
-            const std::string& nameA, const std::string& nameB) {
-        for (auto itC = it; itC != tickets.cend(); itC ++) {
-            const auto& name = itC->first.second;
+    // Searches the journeys by the number of rides, round by round, so that every stop visit is first reached with
+    // the fewest rides. The price only grows with travel time, so the cheapest journey is the one arriving first.
+    // Returns the stop visit ending the best journey, if any.
+    std::optional<StopVisitKey> searchJourney(const Plan& plan, const Network& network, JourneySteps& steps) {
+        const auto& [criterion, origin, departureTime, destination] = plan;
+        std::pmr::memory_resource* scratch = steps.get_allocator().resource();
+        BoardingTimes boardingTimes(scratch);
+        std::pmr::vector<StopVisitKey> frontier(scratch), reached(scratch);
+        std::optional<StopVisitKey> best;
 
-            auto result = compareTicket(totalTime, itC, prev, minPrice);
-            auto updateResult = updateTicketSelectionLoop(result);
+        StopVisitKey start = getStopVisitKey(origin, departureTime);
+        steps.try_emplace(start, 0, start, 0);
+        frontier.push_back(start);
 
-            if(updateResult.first) {
-                minPrice = result.second.first;
-                bestTickets = {nameA, nameB, name};
+        for (std::size_t rides = 1; ! frontier.empty(); rides ++) {
+            reached.clear();
+            for (StopVisitKey from : frontier) {
+                // Nothing reached from a visit later than the best arrival can arrive earlier.
+                if (! best.has_value() || getVisitTime(from) < getVisitTime(best.value())) {
+                    rideFromStopVisit(from, rides, network, steps, boardingTimes, reached);
+                }
             }
-            if (updateResult.second) {
+
+            for (StopVisitKey to : reached) {
+                if (getVisitedStop(to) == destination && (! best.has_value() || to < best.value())) {
+                    best = to;
+                }
+            }
+            if (criterion == FEWEST_RIDES && best.has_value()) {
                 break;
             }
+            frontier.swap(reached);
         }
+
+        return best;
     }
 
-    void select2ndTicket(const TicketSortedMap& tickets, StopTime totalTime, SelectedTickets& bestTickets,
-            unsigned long long& minPrice, const TicketIterator& it, const TicketIteratingInfo& prev,
-            const std::string& nameA) {
-        for (auto itB = it; itB != tickets.cend(); itB++) {
-            const auto &name = itB->first.second;
+    // Lists the stops where the journey boards a line, along with the line, followed by the destination - just
+    // like a query would.
+    Query getJourneyStops(StopVisitKey arrival, const JourneySteps& steps, const StopIndex& stopIndex,
+            std::pmr::memory_resource* scratch) {
+        Query journey(scratch);
+        StopVisitKey visit = arrival;
+        LineNum lineNum = 0;
 
-            auto result = compareTicket(totalTime, itB, prev, minPrice);
-            auto updateResult = updateTicketSelectionLoop(result);
+        while (true) {
+            StopId stopId = getVisitedStop(visit);
+            journey.emplace_back(stopIndex.first[stopId], lineNum, stopId);
 
-            if(updateResult.first) {
-                minPrice = result.second.first;
-                bestTickets = {nameA, name};
-            }
-            if(updateResult.second) {
+            const auto& [rides, from, line] = steps.at(visit);
+            if (rides == 0) {
                 break;
             }
-
-            select3rdTicket(tickets, totalTime, bestTickets, minPrice, itB, result.second, nameA, name);
+            visit = from;
+            lineNum = line;
         }
-    }
 
+        std::reverse(journey.begin(), journey.end());
+        return journey;
+    }
 
-    SelectedTickets selectTickets(const TicketSortedMap& tickets, StopTime totalTime) {
-        unsigned long long minPrice = ULLONG_MAX;
-        SelectedTickets bestTickets;
+    inline bool isTicketSetCheaper(const TicketSet& set, const TicketSet& other) {
+        return (set.first < other.first);
+    }
 
-        for (auto it = tickets.cbegin(); it != tickets.cend(); it ++) {
-            const auto& name = it->first.second;
+    // Saturates, so that absurdly expensive sets never wrap around to look cheap.
+    inline SetPrice addSetPrice(SetPrice setPrice, Price price) {
+        return setPrice + std::min<SetPrice>(price, ULLONG_MAX - setPrice);
+    }
 
-            auto result = compareTicket(totalTime, it, TicketIteratingInfo(0, 0), minPrice);
-            auto updateResult = updateTicketSelectionLoop(result);
+    // Adds a ticket to a set, keeping the tickets ordered by price.
+    TicketSet extendTicketSet(const TicketSet& set, TicketId id, const TicketCatalog& ticketCatalog) {
+        TicketSet extended = set;
+        auto& count = extended.second.first;
+        auto& ids = extended.second.second;
+        const auto& ticket = ticketCatalog[id];
 
-            if(updateResult.first) {
-                minPrice = result.second.first;
-                bestTickets = {name};
-            }
-            if (updateResult.second) {
-                break;
-            }
+        auto priceOrder = [&ticketCatalog](TicketId a, TicketId b) {
+            return std::tie(std::get<1>(ticketCatalog[a]), std::get<0>(ticketCatalog[a]))
+                < std::tie(std::get<1>(ticketCatalog[b]), std::get<0>(ticketCatalog[b]));
+        };
 
-            select2ndTicket(tickets, totalTime, bestTickets, minPrice, it, result.second, name);
-        }
+        // Inserted in place - std::inplace_merge would allocate a buffer for every extended set.
+        extended.first = addSetPrice(extended.first, std::get<1>(ticket));
+        auto position = std::upper_bound(ids.begin(), ids.begin() + count, id, priceOrder);
+        std::move_backward(position, ids.begin() + count, ids.begin() + count + 1);
+        *position = id;
+        count ++;
 
-        return bestTickets;
+        return extended;
     }
 
-    inline ProcessResult processError() {
-        return ProcessResult(ERROR_RESP, std::nullopt);
+    // Collective validity time long enough for any journey of the table - longer ones need not be told apart.
+    inline std::size_t getCoveredTimeLimit(const TicketSelectionTable& ticketTable) {
+        return ticketTable.second.size();
     }
 
-    inline ProcessResult processNoResponse() {
-        return ProcessResult(NO_RESPONSE, std::nullopt);
+    inline std::size_t getCoveredTime(ValidTime validTime, std::size_t coveredTimeLimit) {
+        return static_cast<std::size_t>(std::min<ValidTime>(validTime, coveredTimeLimit));
     }
 
-    inline bool isLineRepeated(const LineNum& lineNum, const Timetable& timetable) {
-        return (timetable.find(lineNum) != timetable.end());
-    }
+    // Updates the cheapest sets of every size with the sets that contain the newly added ticket.
+    void updateTicketLayers(TicketSelectionTable& ticketTable, TicketId id, const TicketCatalog& ticketCatalog) {
+        auto& ticketLayers = ticketTable.first;
+        std::size_t coveredTimeLimit = getCoveredTimeLimit(ticketTable);
+        Price ticketPrice = std::get<1>(ticketCatalog[id]);
+        std::size_t ticketTime = getCoveredTime(std::get<2>(ticketCatalog[id]), coveredTimeLimit);
 
-    ProcessResult processAddRoute(const AddRoute& addRoute, Timetable& timetable) {
-        if (isLineRepeated(addRoute.first, timetable)) {
-            return processError();
+        TicketSet single = extendTicketSet(emptyTicketSet, id, ticketCatalog);
+        if (isTicketSetCheaper(single, ticketLayers[0][ticketTime])) {
+            ticketLayers[0][ticketTime] = single;
         }
 
-        timetable.insert(addRoute);
+        // Layer k already holds the sets using the new ticket, so extending it covers any number of its copies.
+        for (std::size_t k = 1; k < ticketLayers.size(); k ++) {
+            for (std::size_t time = 1; time <= coveredTimeLimit; time ++) {
+                const TicketSet& smaller = ticketLayers[k - 1][time];
+                TicketSet& current = ticketLayers[k][std::min(time + ticketTime, coveredTimeLimit)];
+                if (addSetPrice(smaller.first, ticketPrice) >= current.first) {
+                    continue;
+                }
 
-        return ProcessResult(NO_RESPONSE, std::nullopt);
+                current = extendTicketSet(smaller, id, ticketCatalog);
+            }
+        }
     }
 
-    inline bool isTicketNameRepeated(const std::string& ticketName, const TicketMap& ticketMap) {
-        return (ticketMap.find(ticketName) != ticketMap.end());
+    inline bool isTicketInSet(const TicketSet& set, TicketId id) {
+        const auto& [count, ids] = set.second;
+        return (std::find(ids.begin(), ids.begin() + count, id) != ids.begin() + count);
     }
 
-    void insertTicket(const AddTicket& addTicket, TicketMap& ticketMap, TicketSortedMap& ticketSortedMap) {
-        const std::string& name = addTicket.first;
-        Price price = addTicket.second.first;
-        ValidTime validTime = addTicket.second.second;
+    inline bool isTicketCheaper(TicketId id, TicketId other, const TicketCatalog& ticketCatalog) {
+        return std::tie(std::get<1>(ticketCatalog[id]), id) < std::tie(std::get<1>(ticketCatalog[other]), other);
+    }
 
-        ticketMap.insert({name, price});
-        ticketSortedMap.insert({{price, name}, validTime});
+    void addCoveredTimeTicket(TicketsByCoveredTime& ticketsByTime, TicketId id, std::size_t coveredTimeLimit,
+            const TicketCatalog& ticketCatalog) {
+        auto& sameTime = ticketsByTime[getCoveredTime(std::get<2>(ticketCatalog[id]), coveredTimeLimit)];
+        auto ticketOrder = [&ticketCatalog](TicketId a, TicketId b) { return isTicketCheaper(a, b, ticketCatalog); };
+        sameTime.insert(std::upper_bound(sameTime.begin(), sameTime.end(), id, ticketOrder), id);
     }
 
-    ProcessResult processAddTicket(const AddTicket& addTicket, TicketMap& ticketMap, TicketSortedMap& ticketSortedMap) {
-        const std::string& ticketName = std::get<0>(addTicket);
-        if (isTicketNameRepeated(ticketName, ticketMap)) {
-            return processError();
+    // Has to be called before the ticket's validity time changes.
+    void removeCoveredTimeTicket(TicketsByCoveredTime& ticketsByTime, TicketId id, std::size_t coveredTimeLimit,
+            const TicketCatalog& ticketCatalog) {
+        auto sameTime = ticketsByTime.find(getCoveredTime(std::get<2>(ticketCatalog[id]), coveredTimeLimit));
+        auto& ids = sameTime->second;
+        ids.erase(std::find(ids.begin(), ids.end(), id));
+        if (ids.empty()) {
+            ticketsByTime.erase(sameTime);
         }
-
-        insertTicket(addTicket, ticketMap, ticketSortedMap);
-
-        return processNoResponse();
     }
 
-    ProcessResult processCountingFound(SelectedTickets& tickets, unsigned int& ticketCounter) {
-        if (!tickets.empty()) {
-            ticketCounter += tickets.size();
-            return ProcessResult(FOUND, tickets);
-        } else {
-            return ProcessResult(NOT_FOUND, std::nullopt);
+    // Cheapest set of k + 1 of the tickets with the given collective validity time, out of the sets of k tickets -
+    // any such set is a smaller one extended with the cheapest ticket of some covered time. Sets at the limit may
+    // extend any smaller set that reaches it with the ticket.
+    TicketSet findCheapestTicketSet(const TicketSelectionTable& ticketTable, std::size_t k, std::size_t time,
+            const TicketsByCoveredTime& ticketsByTime, const TicketCatalog& ticketCatalog) {
+        const auto& ticketLayers = ticketTable.first;
+        std::size_t coveredTimeLimit = getCoveredTimeLimit(ticketTable);
+        TicketSet best = noTicketSet;
+
+        if (k == 0) {
+            auto sameTime = ticketsByTime.find(time);
+            return (sameTime == ticketsByTime.end()) ? noTicketSet
+                : extendTicketSet(emptyTicketSet, sameTime->second.front(), ticketCatalog);
         }
-    }
 
-    ProcessResult processQuery(const Query& query, Timetable& timetable,TicketSortedMap& ticketMap,
-            unsigned int& ticketCounter) {
-        auto countingResult = countTravelTime(query, timetable);
+        auto extendCheaper = [&best, &ticketCatalog](const TicketSet& smaller, TicketId id) {
+            if (addSetPrice(smaller.first, std::get<1>(ticketCatalog[id])) < best.first) {
+                best = extendTicketSet(smaller, id, ticketCatalog);
+            }
+        };
 
-        switch (countingResult.first) {
-            case TRAVEL_TIME_FOUND: {
-                SelectedTickets tickets = selectTickets(ticketMap,
-                        std::get<StopTime>(countingResult.second.value_or(0)));
-                return processCountingFound(tickets, ticketCounter);
+        if (time < coveredTimeLimit) {
+            for (auto sameTime = ticketsByTime.begin(); sameTime != ticketsByTime.end() && sameTime->first < time;
+                    sameTime ++) {
+                extendCheaper(ticketLayers[k - 1][time - sameTime->first], sameTime->second.front());
             }
-            case TRAVEL_TIME_WAIT:
-                return ProcessResult(WAIT, Response(std::get<std::string>(countingResult.second.value())));
-            case TRAVEL_TIME_ERR:
-                return ProcessResult(ERROR_RESP, std::nullopt);
+            return best;
         }
 
-        return ProcessResult(NOT_FOUND, std::nullopt);
+        // The smaller sets a ticket may extend start the earlier the longer it is valid, so the cheapest of them is
+        // kept while walking down the smaller times.
+        std::size_t smallerTime = coveredTimeLimit;
+        std::size_t cheapestTime = coveredTimeLimit;
+        for (const auto& [ticketTime, ids] : ticketsByTime) {
+            std::size_t first = std::max<std::size_t>(1, coveredTimeLimit - ticketTime);
+            while (smallerTime > first) {
+                smallerTime --;
+                if (isTicketSetCheaper(ticketLayers[k - 1][smallerTime], ticketLayers[k - 1][cheapestTime])) {
+                    cheapestTime = smallerTime;
+                }
+            }
+            extendCheaper(ticketLayers[k - 1][cheapestTime], ids.front());
+        }
+
+        return best;
     }
 
-    ProcessResult processRequest(const ParseResult& parseResult, TicketMap& ticketMap, TicketSortedMap& ticketSortedMap,
-            Timetable& timetable, uint& ticketCounter) {
-        switch (parseResult.first) {
-            case ADD_ROUTE:
-                return processAddRoute(std::get<AddRoute>(parseResult.second.value()), timetable);
-            case ADD_TICKET:
-                return processAddTicket(std::get<AddTicket>(parseResult.second.value()), ticketMap, ticketSortedMap);
-            case QUERY:
-                return processQuery(std::get<Query>(parseResult.second.value()), timetable,
-                        ticketSortedMap, ticketCounter);
-            case IGNORE:
-                return processNoResponse();
-            default:
-                break;
+    // Recomputes the sets containing a ticket that has just been withdrawn, layer by layer. The other sets stay the
+    // cheapest ones, as the choice of tickets only shrank. A recomputed set costs O(coveredTimes) - the number of
+    // distinct covered times of the class's tickets, at most coveredTimeLimit - and the one at the limit
+    // O(coveredTimeLimit) more. Withdrawing a ticket that is part of most sets thus costs up to
+    // O(ticketLimit * coveredTimeLimit * coveredTimes), as much as adding one ticket of every covered time.
+    void withdrawTicketSets(TicketSelectionTable& ticketTable, TicketId id, const TicketsByCoveredTime& ticketsByTime,
+            const TicketCatalog& ticketCatalog) {
+        auto& ticketLayers = ticketTable.first;
+        for (std::size_t k = 0; k < ticketLayers.size(); k ++) {
+            for (std::size_t time = 1; time <= getCoveredTimeLimit(ticketTable); time ++) {
+                if (isTicketInSet(ticketLayers[k][time], id)) {
+                    ticketLayers[k][time] = findCheapestTicketSet(ticketTable, k, time, ticketsByTime, ticketCatalog);
+                }
+            }
         }
-        return processError();
     }
 
-    void printFound(const std::vector<std::string>& tickets) {
-        bool first = true;
+    // Recomputes the cheapest set for every journey duration - a set has to be valid for longer than the journey.
+    void updateCheapestTicketSets(TicketSelectionTable& ticketTable) {
+        auto& [ticketLayers, cheapestTicketSets] = ticketTable;
+        TicketSet best = noTicketSet;
 
-        std::cout << "! ";
-        for (auto it = tickets.crbegin(); it != tickets.crend(); it++) {
-            if (! first) {
-                std::cout << "; ";
-            } else {
-                first = false;
+        for (std::size_t time = getCoveredTimeLimit(ticketTable); time > 0; time --) {
+            for (const auto& layer : ticketLayers) {
+                if (isTicketSetCheaper(layer[time], best)) {
+                    best = layer[time];
+                }
             }
-
-            std::cout << *it;
+            cheapestTicketSets[time - 1] = best;
         }
-        std::cout << std::endl;
     }
 
-    void printWait(const std::string& stop) {
-        std::cout << ":-( " << stop << std::endl;
+    // Every added ticket costs O(ticketLimit * coveredTimeLimit), and a query stays a single lookup.
+    TicketSelectionTable createTicketSelectionTable(std::size_t ticketLimit, StopTime maxTravelTime) {
+        return TicketSelectionTable(TicketLayers(ticketLimit, TicketSetsByTime(maxTravelTime + 2, noTicketSet)),
+                CheapestTicketSets(maxTravelTime + 1, noTicketSet));
     }
 
-    void printNotFound() {
-        std::cout << ":-|" << std::endl;
+    // Windows have to end no later than maxStopTime, and after they start.
+    inline bool isServiceWindowCorrect(const ServiceWindow& serviceWindow) {
+        return (serviceWindow.first < serviceWindow.second && serviceWindow.second <= maxStopTime);
     }
 
-    void printError(const std::string& inputLine, unsigned int lineCounter) {
-        std::cerr << "Error in line " << lineCounter << ": " << inputLine << std::endl;
-    }
+    Network createNetwork(std::pmr::memory_resource* arena, std::size_t ticketLimit,
+            const ServiceWindow& serviceWindow) {
+        FareClasses fareClasses(arena);
+        fareClasses.emplace_back("", TicketMap(arena),
+                createTicketSelectionTable(ticketLimit, serviceWindow.second - serviceWindow.first),
+                TicketsByCoveredTime());
 
-    void printOutput(const ProcessResult& processResult, const std::string& inputLine, unsigned int lineCounter) {
-        switch (processResult.first) {
-            case FOUND:
-                return printFound(std::get<std::vector<std::string>>(processResult.second.value()));
-            case WAIT:
-                return printWait(std::get<std::string>(processResult.second.value()));
-            case NOT_FOUND:
-                return printNotFound();
-            case NO_RESPONSE:
-                break;
-            case ERROR_RESP:
-                return printError(inputLine, lineCounter);
-        }
+        return {StopIndex(std::pmr::deque<std::pmr::string>(arena),
+                    std::pmr::unordered_map<std::string_view, StopId>(arena)),
+            Timetable(0, TimetableSlots(arena)), TicketCatalog(arena), std::move(fareClasses), StopVisits(arena), 0,
+            serviceWindow};
     }
 
-    void printTicketCount(unsigned int ticketCounter) {
-        std::cout << ticketCounter << std::endl;
+    // Tickets without a tag are in the untagged class, the first one.
+    inline const TicketSelectionTable& getUntaggedTicketTable(const Network& network) {
+        return std::get<TicketSelectionTable>(std::get<FareClasses>(network).front());
+    }
+
+    std::optional<FareClassId> findFareClass(std::string_view tag, const FareClasses& fareClasses) {
+        for (FareClassId id = 0; id < fareClasses.size(); id ++) {
+            if (std::get<0>(fareClasses[id]) == tag) {
+                return id;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Id of the fare class with the tag, added along with an empty table if it is the first ticket of the class.
+    FareClassId addFareClass(std::string_view tag, FareClasses& fareClasses) {
+        auto id = findFareClass(tag, fareClasses);
+        if (id.has_value()) {
+            return id.value();
+        }
+
+        // The new table is empty, but of the same size as the untagged one.
+        const auto& untaggedTable = std::get<TicketSelectionTable>(fareClasses.front());
+        fareClasses.emplace_back(tag, TicketMap(fareClasses.get_allocator()),
+                createTicketSelectionTable(untaggedTable.first.size(), untaggedTable.second.size() - 1),
+                TicketsByCoveredTime());
+        return static_cast<FareClassId>(fareClasses.size() - 1);
+    }
+
+    SelectedTickets selectTickets(const TicketSelectionTable& ticketTable, const TicketCatalog& ticketCatalog,
+            StopTime totalTime, std::pmr::memory_resource* scratch) {
+        const TicketSet& best = ticketTable.second[totalTime];
+        SelectedTickets selectedTickets(scratch);
+
+        for (std::size_t i = 0; i < best.second.first; i ++) {
+            TicketId id = best.second.second[i];
+            selectedTickets.emplace_back(std::get<0>(ticketCatalog[id]), id);
+        }
+
+        return selectedTickets;
+    }
+
+    inline ProcessResult processError() {
+        return ProcessResult(ERROR_RESP, std::nullopt);
+    }
+
+    inline ProcessResult processNoResponse() {
+        return ProcessResult(NO_RESPONSE, std::nullopt);
+    }
+
+    ProcessResult processAddRoute(AddRoute& addRoute, Timetable& timetable, StopVisits& stopVisits) {
+        if (isLineRepeated(addRoute.first, timetable)) {
+            return processError();
+        }
+
+        indexRoute(addRoute.first, addRoute.second, stopVisits);
+        insertRoute(addRoute.first, std::move(addRoute.second), timetable);
+
+        return ProcessResult(NO_RESPONSE, std::nullopt);
+    }
+
+    inline bool isTicketNameRepeated(std::string_view ticketName, const TicketMap& ticketMap) {
+        auto ticket = ticketMap.find(ticketName);
+        return (ticket != ticketMap.end() && ticket->second != withdrawnTicketId);
+    }
+
+    // Updates the table with the sets that contain the newly added ticket.
+    void addTicketSets(TicketSelectionTable& ticketTable, TicketId id, const TicketCatalog& ticketCatalog) {
+        updateTicketLayers(ticketTable, id, ticketCatalog);
+        updateCheapestTicketSets(ticketTable);
+    }
+
+    // Only the table of the ticket's fare class is updated, so fare classes cost nothing to the others.
+    void insertTicket(const AddTicket& addTicket, TicketCatalog& ticketCatalog, FareClasses& fareClasses) {
+        const auto& [name, price, validTime, tag] = addTicket;
+        FareClassId fareClassId = addFareClass(tag, fareClasses);
+        auto& [fareClass, ticketMap, ticketTable, ticketsByTime] = fareClasses[fareClassId];
+
+        auto id = static_cast<TicketId>(ticketCatalog.size());
+        ticketCatalog.emplace_back(name, price, validTime, fareClassId);
+        ticketMap.insert_or_assign(std::get<0>(ticketCatalog.back()), id);
+        addCoveredTimeTicket(ticketsByTime, id, getCoveredTimeLimit(ticketTable), ticketCatalog);
+
+        addTicketSets(ticketTable, id, ticketCatalog);
+    }
+
+    // Names have to be unique within a fare class only.
+    ProcessResult processAddTicket(const AddTicket& addTicket, TicketCatalog& ticketCatalog,
+            FareClasses& fareClasses, TicketEpoch& ticketEpoch) {
+        const auto& [ticketName, price, validTime, tag] = addTicket;
+        auto fareClassId = findFareClass(tag, fareClasses);
+        if (fareClassId.has_value()
+                && isTicketNameRepeated(ticketName, std::get<TicketMap>(fareClasses[fareClassId.value()]))) {
+            return processError();
+        }
+
+        insertTicket(addTicket, ticketCatalog, fareClasses);
+        ticketEpoch ++;
+
+        return processNoResponse();
+    }
+
+    // Id of a current ticket of the fare class with the tag, if there is one, and the class itself.
+    std::optional<std::pair<TicketId, FareClass*>> findClassTicket(std::string_view ticketName, std::string_view tag,
+            FareClasses& fareClasses) {
+        auto fareClassId = findFareClass(tag, fareClasses);
+        if (! fareClassId.has_value()) {
+            return std::nullopt;
+        }
+
+        FareClass& fareClass = fareClasses[fareClassId.value()];
+        const TicketMap& ticketMap = std::get<TicketMap>(fareClass);
+        auto ticket = ticketMap.find(ticketName);
+        if (ticket == ticketMap.end() || ticket->second == withdrawnTicketId) {
+            return std::nullopt;
+        }
+        return std::make_pair(ticket->second, &fareClass);
+    }
+
+    // Takes a ticket out of its class's tickets by covered time and recomputes just the sets it was part of. Its map
+    // entry is left to the caller.
+    void withdrawTicket(TicketId id, FareClass& fareClass, const TicketCatalog& ticketCatalog) {
+        auto& [tag, ticketMap, ticketTable, ticketsByTime] = fareClass;
+
+        removeCoveredTimeTicket(ticketsByTime, id, getCoveredTimeLimit(ticketTable), ticketCatalog);
+        withdrawTicketSets(ticketTable, id, ticketsByTime, ticketCatalog);
+    }
+
+    // Withdrawn tickets are the ones their class's map does not lead to, as their entries may have been marked or
+    // taken over by a ticket of the same name.
+    inline bool isTicketWithdrawn(TicketId id, const TicketCatalog& ticketCatalog, const FareClasses& fareClasses) {
+        const auto& [name, price, validTime, fareClassId] = ticketCatalog[id];
+        const TicketMap& ticketMap = std::get<TicketMap>(fareClasses[fareClassId]);
+        auto ticket = ticketMap.find(name);
+        return (ticket == ticketMap.end() || ticket->second != id);
+    }
+
+    ProcessResult processRemoveTicket(const RemoveTicket& removeTicket, const TicketCatalog& ticketCatalog,
+            FareClasses& fareClasses, TicketEpoch& ticketEpoch) {
+        auto ticket = findClassTicket(removeTicket.first, removeTicket.second, fareClasses);
+        if (! ticket.has_value()) {
+            return processError();
+        }
+        auto [id, fareClass] = ticket.value();
+
+        std::get<TicketMap>(*fareClass).at(removeTicket.first) = withdrawnTicketId;
+        withdrawTicket(id, *fareClass, ticketCatalog);
+        updateCheapestTicketSets(std::get<TicketSelectionTable>(*fareClass));
+        ticketEpoch ++;
+
+        return processNoResponse();
+    }
+
+    // A repriced ticket keeps its id and its map entry - it is withdrawn from the sets and then added anew, with the
+    // new price and validity time in place of the old ones, so that tariff changes allocate nothing in the arena.
+    ProcessResult processRepriceTicket(const AddTicket& repriceTicket, TicketCatalog& ticketCatalog,
+            FareClasses& fareClasses, TicketEpoch& ticketEpoch) {
+        const auto& [ticketName, price, validTime, tag] = repriceTicket;
+        auto ticket = findClassTicket(ticketName, tag, fareClasses);
+        if (! ticket.has_value()) {
+            return processError();
+        }
+        auto [id, fareClass] = ticket.value();
+        auto& [fareClassTag, ticketMap, ticketTable, ticketsByTime] = *fareClass;
+
+        withdrawTicket(id, *fareClass, ticketCatalog);
+        std::get<1>(ticketCatalog[id]) = price;
+        std::get<2>(ticketCatalog[id]) = validTime;
+        addCoveredTimeTicket(ticketsByTime, id, getCoveredTimeLimit(ticketTable), ticketCatalog);
+
+        addTicketSets(ticketTable, id, ticketCatalog);
+        ticketEpoch ++;
+
+        return processNoResponse();
+    }
+
+    ProcessResult processCountingFound(SelectedTickets& tickets, unsigned int& ticketCounter) {
+        if (!tickets.empty()) {
+            ticketCounter += tickets.size();
+            return ProcessResult(FOUND, std::move(tickets));
+        } else {
+            return ProcessResult(NOT_FOUND, std::nullopt);
+        }
+    }
+
+    // Selects tickets of every fare class for a journey whose travel time has been counted once; every class is just
+    // another lookup. Classes without a set for the journey are left out.
+    ProcessResult processCountingFoundFares(const Network& network, StopTime totalTime, unsigned int& ticketCounter,
+            std::pmr::memory_resource* scratch) {
+        FareTickets fareTickets(scratch);
+
+        for (const auto& [fareClass, ticketMap, ticketTable, ticketsByTime] : std::get<FareClasses>(network)) {
+            SelectedTickets tickets = selectTickets(ticketTable, std::get<TicketCatalog>(network), totalTime, scratch);
+            if (! tickets.empty()) {
+                ticketCounter += tickets.size();
+                fareTickets.emplace_back(fareClass, std::move(tickets));
+            }
+        }
+
+        if (fareTickets.empty()) {
+            return ProcessResult(NOT_FOUND, std::nullopt);
+        }
+        return ProcessResult(FOUND_FARES, Response(std::move(fareTickets)));
+    }
+
+    // Only reads the network, so queries may be evaluated concurrently as long as it does not change.
+    ProcessResult processQuery(const Query& query, const Network& network, unsigned int& ticketCounter) {
+        auto countingResult = countTravelTime(query, std::get<Timetable>(network));
+
+        switch (countingResult.first) {
+            case TRAVEL_TIME_FOUND: {
+                // The response is allocated along with the query.
+                StopTime totalTime = std::get<StopTime>(countingResult.second.value_or(StopTime(0)));
+                if (std::get<FareClasses>(network).size() > 1) {
+                    return processCountingFoundFares(network, totalTime, ticketCounter,
+                            query.get_allocator().resource());
+                }
+
+                SelectedTickets tickets = selectTickets(getUntaggedTicketTable(network),
+                        std::get<TicketCatalog>(network), totalTime, query.get_allocator().resource());
+                return processCountingFound(tickets, ticketCounter);
+            }
+            case TRAVEL_TIME_WAIT:
+                return ProcessResult(WAIT, Response(std::get<std::string_view>(countingResult.second.value())));
+            case TRAVEL_TIME_ERR:
+                return ProcessResult(ERROR_RESP, std::nullopt);
+        }
+
+        return ProcessResult(NOT_FOUND, std::nullopt);
+    }
+
+    // Plans the journey and selects untagged tickets for it. Only reads the network, just like a query. A search may
+    // visit much of the network, so it gets an arena of its own, freed as soon as the journey is copied out of it.
+    ProcessResult processPlan(const Plan& plan, const Network& network, unsigned int& ticketCounter,
+            std::pmr::memory_resource* scratch) {
+        // Typical searches fit in the buffer, so they allocate nothing.
+        std::array<char, searchArenaSize> searchBuffer;
+        std::pmr::monotonic_buffer_resource searchArena(searchBuffer.data(), searchBuffer.size());
+        JourneySteps steps(&searchArena);
+        auto arrival = searchJourney(plan, network, steps);
+        if (! arrival.has_value()) {
+            return ProcessResult(NOT_FOUND, std::nullopt);
+        }
+
+        SelectedTickets tickets = selectTickets(getUntaggedTicketTable(network), std::get<TicketCatalog>(network),
+                getVisitTime(arrival.value()) - std::get<2>(plan), scratch);
+        ticketCounter += tickets.size();
+
+        Query journey = getJourneyStops(arrival.value(), steps, std::get<StopIndex>(network), scratch);
+        return ProcessResult(PLANNED, Response(PlannedJourney(std::move(journey), std::move(tickets))));
+    }
+
+    ProcessResult processRequest(ParseResult& parseResult, Network& network, unsigned int& ticketCounter,
+            std::pmr::memory_resource* scratch) {
+        switch (parseResult.first) {
+            case ADD_ROUTE:
+                return processAddRoute(std::get<AddRoute>(parseResult.second.value()), std::get<Timetable>(network),
+                        std::get<StopVisits>(network));
+            case ADD_TICKET:
+                return processAddTicket(std::get<AddTicket>(parseResult.second.value()),
+                        std::get<TicketCatalog>(network), std::get<FareClasses>(network),
+                        std::get<TicketEpoch>(network));
+            case REMOVE_TICKET:
+                return processRemoveTicket(std::get<RemoveTicket>(parseResult.second.value()),
+                        std::get<TicketCatalog>(network), std::get<FareClasses>(network),
+                        std::get<TicketEpoch>(network));
+            case REPRICE_TICKET:
+                return processRepriceTicket(std::get<AddTicket>(parseResult.second.value()),
+                        std::get<TicketCatalog>(network), std::get<FareClasses>(network),
+                        std::get<TicketEpoch>(network));
+            case QUERY:
+                return processQuery(std::get<Query>(parseResult.second.value()), network, ticketCounter);
+            case PLAN:
+                return processPlan(std::get<Plan>(parseResult.second.value()), network, ticketCounter, scratch);
+            case IGNORE:
+                return processNoResponse();
+            default:
+                break;
+        }
+        return processError();
+    }
+
+    // Number of tickets proposed in a response.
+    std::size_t getProposedTicketCount(const ProcessResult& processResult) {
+        switch (processResult.first) {
+            case FOUND:
+                return std::get<SelectedTickets>(processResult.second.value()).size();
+            case PLANNED:
+                return std::get<PlannedJourney>(processResult.second.value()).second.size();
+            case FOUND_FARES: {
+                std::size_t ticketCount = 0;
+                for (const auto& [fareClass, tickets] : std::get<FareTickets>(processResult.second.value())) {
+                    ticketCount += tickets.size();
+                }
+                return ticketCount;
+            }
+            default:
+                return 0;
+        }
+    }
+
+    // One cache per worker, so that workers never share one; no caches if the capacity is 0.
+    std::vector<QueryCache> createQueryCaches(std::size_t capacity, unsigned int workerCount) {
+        std::vector<QueryCache> queryCaches;
+
+        if (capacity > 0) {
+            for (unsigned int worker = 0; worker < workerCount; worker ++) {
+                queryCaches.emplace_back(QueryCacheEntries(), std::unordered_map<std::string_view,
+                        QueryCacheEntries::iterator>(), capacity, 0, 0);
+            }
+        }
+
+        return queryCaches;
+    }
+
+    inline TicketEpoch getTicketEpoch(const Network& network) {
+        return std::get<TicketEpoch>(network);
+    }
+
+    // Stops keep their ids and routes never change once added, so a query whose routes were all found keeps its
+    // travel time, and its result depends only on the tickets. Erroneous queries might refer to routes or stops
+    // that are yet to come.
+    inline bool isQueryResultCacheable(const ProcessResult& processResult) {
+        return (processResult.first == FOUND || processResult.first == FOUND_FARES || processResult.first == WAIT
+                || processResult.first == NOT_FOUND);
+    }
+
+    // Returns the result cached in the current epoch, making it the most recently used one.
+    const ProcessResult* findCachedQuery(QueryCache& queryCache, std::string_view key, TicketEpoch epoch) {
+        auto& [entries, index, capacity, hits, misses] = queryCache;
+
+        auto it = index.find(key);
+        if (it == index.end() || it->second->second.first != epoch) {
+            misses ++;
+            return nullptr;
+        }
+
+        hits ++;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second.second;
+    }
+
+    // Stores the result, evicting the least recently used one if the cache is full. Names in the result point into
+    // the query's line, so they are redirected to the stop index.
+    void cacheQueryResult(QueryCache& queryCache, std::string_view key, TicketEpoch epoch,
+            const ProcessResult& processResult, const StopIndex& stopIndex) {
+        auto& [entries, index, capacity, hits, misses] = queryCache;
+
+        ProcessResult cachedResult = processResult;
+        if (cachedResult.first == WAIT) {
+            std::string_view stopName = std::get<std::string_view>(cachedResult.second.value());
+            cachedResult.second = Response(std::string_view(stopIndex.first[findStop(stopName, stopIndex)]));
+        }
+
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->second = CachedQueryResult(epoch, std::move(cachedResult));
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+
+        if (entries.size() >= capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.emplace_front(QueryKey(key), CachedQueryResult(epoch, std::move(cachedResult)));
+        index.insert({entries.front().first, entries.begin()});
+    }
+
+    // Copies a cached result into the scratch arena, counting its tickets as if it were just computed.
+    ProcessResult reuseCachedQuery(const ProcessResult& cachedResult, unsigned int& ticketCounter,
+            std::pmr::memory_resource* scratch) {
+        ticketCounter += getProposedTicketCount(cachedResult);
+
+        switch (cachedResult.first) {
+            case FOUND:
+                return ProcessResult(FOUND,
+                        Response(SelectedTickets(std::get<SelectedTickets>(cachedResult.second.value()), scratch)));
+            case FOUND_FARES:
+                return ProcessResult(FOUND_FARES,
+                        Response(FareTickets(std::get<FareTickets>(cachedResult.second.value()), scratch)));
+            default:
+                return cachedResult;
+        }
+    }
+
+    // Bucket of a latency: exact below histogramSubBucketCount nanoseconds, then histogramSubBucketCount
+    // buckets per power of two, so that every bucket is within 1/16 of the latencies it counts.
+    inline std::size_t getHistogramBucket(std::uint64_t nanoseconds) {
+        if (nanoseconds < histogramSubBucketCount) {
+            return static_cast<std::size_t>(nanoseconds);
+        }
+
+        std::size_t shift = 63 - __builtin_clzll(nanoseconds) - 4;
+        std::size_t subBucket = static_cast<std::size_t>(nanoseconds >> shift) - histogramSubBucketCount;
+        return histogramSubBucketCount * (shift + 1) + subBucket;
+    }
+
+    // Highest latency counted in a bucket.
+    inline std::uint64_t getHistogramBucketLimit(std::size_t bucket) {
+        if (bucket < histogramSubBucketCount) {
+            return bucket;
+        }
+
+        std::size_t shift = bucket / histogramSubBucketCount - 1;
+        std::uint64_t subBucket = bucket % histogramSubBucketCount + histogramSubBucketCount;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+    std::uint64_t getPercentile(const LatencyHistogram& histogram, std::uint64_t count, double percentile) {
+        auto rank = static_cast<std::uint64_t>(std::ceil(percentile / 100 * count));
+        std::uint64_t seen = 0;
+
+        for (std::size_t bucket = 0; bucket < histogram.size(); bucket ++) {
+            seen += histogram[bucket];
+            if (seen >= std::max<std::uint64_t>(rank, 1)) {
+                return getHistogramBucketLimit(bucket);
+            }
+        }
+        return 0;
+    }
+
+    // Takes a timestamp only when profiling, so that a disabled profile costs a single branch.
+    inline Clock::time_point startTiming(const Profile* profile) {
+        return (profile != nullptr) ? Clock::now() : Clock::time_point();
+    }
+
+    inline std::uint64_t toNanoseconds(Clock::duration duration) {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    inline void recordPhase(Profile* profile, Phase phase, Clock::time_point start) {
+        if (profile != nullptr) {
+            std::get<2>(*profile)[phase] += toNanoseconds(Clock::now() - start);
+        }
+    }
+
+    // Records a line parsed from start and processed from parsed till now.
+    inline void recordLine(Profile* profile, RequestType requestType, Clock::time_point start,
+            Clock::time_point parsed) {
+        if (profile == nullptr) {
+            return;
+        }
+
+        auto& [counts, histograms, phaseTimes] = *profile;
+        std::uint64_t parseTime = toNanoseconds(parsed - start);
+        std::uint64_t processTime = toNanoseconds(Clock::now() - parsed);
+
+        counts[requestType] ++;
+        histograms[requestType][getHistogramBucket(parseTime + processTime)] ++;
+        phaseTimes[PHASE_PARSE] += parseTime;
+        phaseTimes[PHASE_PROCESS] += processTime;
+    }
+
+    void mergeProfile(Profile& profile, const Profile& other) {
+        for (std::size_t type = 0; type < requestTypeCount; type ++) {
+            std::get<0>(profile)[type] += std::get<0>(other)[type];
+            for (std::size_t bucket = 0; bucket < histogramBucketCount; bucket ++) {
+                std::get<1>(profile)[type][bucket] += std::get<1>(other)[type][bucket];
+            }
+        }
+        for (std::size_t phase = 0; phase < phaseCount; phase ++) {
+            std::get<2>(profile)[phase] += std::get<2>(other)[phase];
+        }
+    }
+
+    std::string profileToJson(const Profile& profile, const std::vector<QueryCache>& queryCaches) {
+        static const std::array<const char*, requestTypeCount> typeNames = {
+            "ADD_ROUTE", "ADD_TICKET", "REMOVE_TICKET", "REPRICE_TICKET", "QUERY", "PLAN", "IGNORE", "ERROR_REQ"
+        };
+        static const std::array<const char*, phaseCount> phaseNames = {"parse", "process", "print"};
+        const auto& [counts, histograms, phaseTimes] = profile;
+
+        std::string json = "{\"phases_ns\": {";
+        for (std::size_t phase = 0; phase < phaseCount; phase ++) {
+            json += std::string(phase > 0 ? ", " : "") + "\"" + phaseNames[phase] + "\": "
+                + std::to_string(phaseTimes[phase]);
+        }
+
+        json += "}, \"requests\": {";
+        for (std::size_t type = 0; type < requestTypeCount; type ++) {
+            json += std::string(type > 0 ? ", " : "") + "\"" + typeNames[type] + "\": {\"count\": "
+                + std::to_string(counts[type]);
+            for (auto [name, percentile] : {std::pair("p50", 50.0), std::pair("p99", 99.0), std::pair("p999", 99.9)}) {
+                json += std::string(", \"") + name + "_ns\": "
+                    + std::to_string(getPercentile(histograms[type], counts[type], percentile));
+            }
+            json += "}";
+        }
+
+        std::uint64_t hits = 0, misses = 0;
+        for (const auto& queryCache : queryCaches) {
+            hits += std::get<3>(queryCache);
+            misses += std::get<4>(queryCache);
+        }
+        json += "}, \"query_cache\": {\"hits\": " + std::to_string(hits) + ", \"misses\": " + std::to_string(misses);
+
+        return json + "}}\n";
+    }
+
+    bool writeAll(int fd, std::string_view data) {
+        while (! data.empty()) {
+            ssize_t written = write(fd, data.data(), data.size());
+            if (written < 0 && errno == EINTR) {
+                continue;
+            } else if (written <= 0) {
+                return false;
+            }
+            data.remove_prefix(static_cast<std::size_t>(written));
+        }
+
+        return true;
+    }
+
+    inline void writeProfile(const Profile& profile, const std::vector<QueryCache>& queryCaches, int fd) {
+        writeAll(fd, profileToJson(profile, queryCaches));
+    }
+
+    inline void countId(std::vector<std::uint64_t>& counts, std::size_t id) {
+        if (id >= counts.size()) {
+            counts.resize(id + 1);
+        }
+        counts[id] ++;
+    }
+
+    // Ids are unique across fare classes, so tickets are counted without looking up their class.
+    void countSelectedTickets(std::vector<std::uint64_t>& selections, const SelectedTickets& tickets) {
+        for (const auto& [name, id] : tickets) {
+            countId(selections, id);
+        }
+    }
+
+    // Records the tickets selected for a query or a plan and the stop where a passenger would have to wait.
+    void recordResponseStats(HotspotStats* stats, const ProcessResult& processResult, const Network& network) {
+        if (stats == nullptr) {
+            return;
+        }
+
+        auto& [stopQueries, lineRides, ticketSelections, stopWaits] = *stats;
+        switch (processResult.first) {
+            case FOUND:
+                countSelectedTickets(ticketSelections, std::get<SelectedTickets>(processResult.second.value()));
+                break;
+            case FOUND_FARES:
+                for (const auto& [fareClass, tickets] : std::get<FareTickets>(processResult.second.value())) {
+                    countSelectedTickets(ticketSelections, tickets);
+                }
+                break;
+            case PLANNED:
+                countSelectedTickets(ticketSelections, std::get<PlannedJourney>(processResult.second.value()).second);
+                break;
+            case WAIT: {
+                StopId stopId = findStop(std::get<std::string_view>(processResult.second.value()),
+                        std::get<StopIndex>(network));
+                if (stopId != noStopId) {
+                    countId(stopWaits, stopId);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // Records the stops and lines of an answered query, along with its response. Queries answered with an error
+    // might name lines that do not exist, so they are left out.
+    void recordQueryStats(HotspotStats* stats, const Query& query, const ProcessResult& processResult,
+            const Network& network) {
+        if (stats == nullptr || processResult.first == ERROR_RESP) {
+            return;
+        }
+
+        auto& [stopQueries, lineRides, ticketSelections, stopWaits] = *stats;
+        for (std::size_t i = 0; i < query.size(); i ++) {
+            const auto& [stopName, lineNum, stopId] = query[i];
+            if (stopId != noStopId) {
+                countId(stopQueries, stopId);
+            }
+            // The line of the last stop is never ridden.
+            if (i + 1 < query.size()) {
+                lineRides[lineNum] ++;
+            }
+        }
+        recordResponseStats(stats, processResult, network);
+    }
+
+    inline HotspotStats* getWorkerStats(StatsCollector* statsCollector, std::size_t worker) {
+        return (statsCollector != nullptr) ? &std::get<0>(*statsCollector)[worker] : nullptr;
+    }
+
+    void mergeCounts(std::vector<std::uint64_t>& counts, const std::vector<std::uint64_t>& other) {
+        counts.resize(std::max(counts.size(), other.size()));
+        for (std::size_t id = 0; id < other.size(); id ++) {
+            counts[id] += other[id];
+        }
+    }
+
+    void mergeHotspotStats(HotspotStats& stats, const HotspotStats& other) {
+        mergeCounts(std::get<0>(stats), std::get<0>(other));
+        for (auto [lineNum, rides] : std::get<1>(other)) {
+            std::get<1>(stats)[lineNum] += rides;
+        }
+        mergeCounts(std::get<2>(stats), std::get<2>(other));
+        mergeCounts(std::get<3>(stats), std::get<3>(other));
+    }
+
+    // Entries with the highest counts, the lowest id first among equal ones.
+    StatsEntries getTopEntries(StatsEntries entries, std::size_t topCount) {
+        auto isHigher = [](const auto& a, const auto& b) {
+            return (a.second != b.second) ? (a.second > b.second) : (a.first < b.first);
+        };
+        std::size_t count = std::min(topCount, entries.size());
+        std::partial_sort(entries.begin(), entries.begin() + count, entries.end(), isHigher);
+        entries.resize(count);
+
+        return entries;
+    }
+
+    StatsEntries getTopEntries(const std::vector<std::uint64_t>& counts, std::size_t topCount) {
+        StatsEntries entries;
+        for (std::size_t id = 0; id < counts.size(); id ++) {
+            if (counts[id] > 0) {
+                entries.emplace_back(id, counts[id]);
+            }
+        }
+        return getTopEntries(std::move(entries), topCount);
+    }
+
+    // Names of stops and tickets are made of letters, spaces, '^' and '_', so they need no escaping.
+    std::string statsToJson(const HotspotStats& stats, const Network& network, std::size_t topCount) {
+        const auto& [stopQueries, lineRides, ticketSelections, stopWaits] = stats;
+        const auto& stopNames = std::get<StopIndex>(network).first;
+        const TicketCatalog& ticketCatalog = std::get<TicketCatalog>(network);
+        const FareClasses& fareClasses = std::get<FareClasses>(network);
+
+        auto listStops = [&stopNames](const StatsEntries& entries, const char* countName) {
+            std::string json;
+            for (const auto& [stopId, count] : entries) {
+                json += std::string(json.empty() ? "" : ", ") + "{\"stop\": \"" + stopNames[stopId].c_str()
+                    + "\", \"" + countName + "\": " + std::to_string(count) + "}";
+            }
+            return json;
+        };
+
+        std::string json = "{\"stops\": [" + listStops(getTopEntries(stopQueries, topCount), "queries");
+
+        json += "], \"lines\": [";
+        StatsEntries lineEntries(lineRides.begin(), lineRides.end());
+        std::string separator;
+        for (const auto& [lineNum, rides] : getTopEntries(std::move(lineEntries), topCount)) {
+            json += separator + "{\"line\": " + std::to_string(lineNum) + ", \"rides\": " + std::to_string(rides) + "}";
+            separator = ", ";
+        }
+
+        json += "], \"tickets\": [";
+        separator.clear();
+        for (const auto& [ticketId, selections] : getTopEntries(ticketSelections, topCount)) {
+            const auto& [name, price, validTime, fareClassId] = ticketCatalog[ticketId];
+            json += separator + "{\"ticket\": \"" + name.c_str() + "\", \"fare_class\": \""
+                + std::get<0>(fareClasses[fareClassId]).c_str() + "\", \"selections\": " + std::to_string(selections)
+                + "}";
+            separator = ", ";
+        }
+
+        json += "], \"waits\": [" + listStops(getTopEntries(stopWaits, topCount), "waits");
+
+        return json + "]}\n";
+    }
+
+    // Workers have to be idle, as their statistics are merged for the report.
+    void writeStats(const StatsCollector& statsCollector, const Network& network) {
+        const auto& [workerStats, fd, topCount] = statsCollector;
+        HotspotStats stats;
+        for (const auto& other : workerStats) {
+            mergeHotspotStats(stats, other);
+        }
+        writeAll(fd, statsToJson(stats, network, topCount));
+    }
+
+    // Writes a report if SIGUSR1 has asked for one since the last check.
+    inline void writeRequestedStats(const StatsCollector* statsCollector, const Network& network) {
+        if (statsCollector != nullptr && isStatsReportRequested != 0) {
+            isStatsReportRequested = 0;
+            writeStats(*statsCollector, network);
+        }
+    }
+
+    void requestStatsReport(int) {
+        isStatsReportRequested = 1;
+    }
+
+    // Blocking calls are restarted, so the report waits for the batch being read or handled.
+    bool handleStatsSignal() {
+        struct sigaction action = {};
+        action.sa_handler = requestStatsReport;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+
+        return (sigaction(SIGUSR1, &action, nullptr) == 0);
+    }
+
+    // Parses and processes a single line.
+    ProcessResult handleLine(std::string_view line, Network& network, unsigned int& ticketCounter,
+            std::pmr::memory_resource* scratch, Profile* profile) {
+        Clock::time_point start = startTiming(profile);
+        ParseResult parseResult = parseInputLine(line, network, scratch);
+        Clock::time_point parsed = startTiming(profile);
+
+        ProcessResult processResult = processRequest(parseResult, network, ticketCounter, scratch);
+        recordLine(profile, parseResult.first, start, parsed);
+
+        return processResult;
+    }
+
+    // Parses and processes a query or plan line; the network is only read. A query found in the cache is not parsed
+    // at all, unless its stops are needed for statistics. Plans are never cached, as new routes might make for
+    // better journeys.
+    ProcessResult handleQueryLine(std::string_view line, const Network& network, unsigned int& ticketCounter,
+            QueryCache* queryCache, std::pmr::memory_resource* scratch, Profile* profile, HotspotStats* stats) {
+        Clock::time_point start = startTiming(profile);
+        TicketEpoch epoch = getTicketEpoch(network);
+        bool isPlan = (getRequestType(line) == PLAN);
+
+        const ProcessResult* cachedResult = (queryCache != nullptr && ! isPlan)
+            ? findCachedQuery(*queryCache, line, epoch) : nullptr;
+        if (cachedResult != nullptr) {
+            ProcessResult processResult = reuseCachedQuery(*cachedResult, ticketCounter, scratch);
+            if (stats != nullptr) {
+                ParseResult parseResult = parseQuery(line, std::get<StopIndex>(network), scratch);
+                if (parseResult.first == QUERY) {
+                    recordQueryStats(stats, std::get<Query>(parseResult.second.value()), processResult, network);
+                }
+            }
+            recordLine(profile, QUERY, start, start);
+            return processResult;
+        }
+
+        ParseResult parseResult = isPlan
+            ? parsePlan(line, std::get<StopIndex>(network), std::get<ServiceWindow>(network))
+            : parseQuery(line, std::get<StopIndex>(network), scratch);
+        Clock::time_point parsed = startTiming(profile);
+
+        ProcessResult processResult = processError();
+        if (parseResult.first == PLAN) {
+            processResult = processPlan(std::get<Plan>(parseResult.second.value()), network, ticketCounter, scratch);
+            recordResponseStats(stats, processResult, network);
+        } else if (parseResult.first == QUERY) {
+            processResult = processQuery(std::get<Query>(parseResult.second.value()), network, ticketCounter);
+            recordQueryStats(stats, std::get<Query>(parseResult.second.value()), processResult, network);
+            if (queryCache != nullptr && isQueryResultCacheable(processResult)) {
+                cacheQueryResult(*queryCache, line, epoch, processResult, std::get<StopIndex>(network));
+            }
+        }
+        recordLine(profile, parseResult.first, start, parsed);
+
+        return processResult;
+    }
+
+    // Backs off while the other end of a batch queue catches up - spinning at first, then yielding the processor,
+    // and finally sleeping longer and longer, so that a pipeline waiting for interactive input stays idle.
+    inline void waitForBatchQueue(unsigned int& attempts) {
+        attempts ++;
+        if (attempts >= 2048) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        } else if (attempts >= 1024) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        } else if (attempts >= 64) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Pushes a batch to a queue; only a single thread may push to it.
+    template<typename Batch>
+    void pushBatch(LockFreeQueue<Batch>& queue, Batch* batch) {
+        auto& [slots, pushed, popped] = queue;
+        std::size_t tail = pushed.load(std::memory_order_relaxed);
+
+        unsigned int attempts = 0;
+        while (tail - popped.load(std::memory_order_acquire) == slots.size()) {
+            waitForBatchQueue(attempts);
+        }
+
+        slots[tail & (slots.size() - 1)] = batch;
+        pushed.store(tail + 1, std::memory_order_release);
+    }
+
+    // Pops a batch from a queue, waiting for one if it is empty; only a single thread may pop from it.
+    template<typename Batch>
+    Batch* popBatch(LockFreeQueue<Batch>& queue) {
+        auto& [slots, pushed, popped] = queue;
+        std::size_t head = popped.load(std::memory_order_relaxed);
+
+        unsigned int attempts = 0;
+        while (pushed.load(std::memory_order_acquire) == head) {
+            waitForBatchQueue(attempts);
+        }
+
+        Batch* batch = slots[head & (slots.size() - 1)];
+        popped.store(head + 1, std::memory_order_release);
+        return batch;
+    }
+
+    std::vector<ScratchArena> createScratchArenas(unsigned int workerCount) {
+        std::vector<ScratchArena> scratchArenas;
+
+        for (unsigned int worker = 0; worker < workerCount; worker ++) {
+            auto buffer = std::make_unique<char[]>(scratchArenaSize);
+            auto arena = std::make_unique<std::pmr::monotonic_buffer_resource>(buffer.get(), scratchArenaSize);
+            scratchArenas.emplace_back(std::move(buffer), std::move(arena));
+        }
+
+        return scratchArenas;
+    }
+
+    // Frees everything allocated for a batch at once, so the next batch reuses the same buffers. The results
+    // point into the arenas, so they go first.
+    void releaseScratchArenas(std::vector<ScratchArena>& scratchArenas, std::vector<ProcessResult>& results) {
+        results.clear();
+        for (auto& scratchArena : scratchArenas) {
+            scratchArena.second->release();
+        }
+    }
+
+    inline bool isReadOnlyRequest(RequestType requestType) {
+        return (requestType == QUERY || requestType == PLAN);
+    }
+
+    // Requests whose effect on the network outlives them, and so has to be journaled.
+    inline bool isNetworkChange(RequestType requestType) {
+        return (requestType == ADD_ROUTE || requestType == ADD_TICKET || requestType == REMOVE_TICKET
+                || requestType == REPRICE_TICKET);
+    }
+
+    // Evaluates the queries among lines [from, to) of a run with the worker's own cache, arena and statistics.
+    // Returns the number of tickets proposed.
+    unsigned int evaluateQueryRange(const QueryRun& run, std::size_t from, std::size_t to, std::size_t worker,
+            Profile* profile) {
+        const auto& [batch, network, results, queryCaches, scratchArenas, statsCollector] = run;
+        QueryCache* queryCache = queryCaches.empty() ? nullptr : &queryCaches[worker];
+        std::pmr::memory_resource* scratch = scratchArenas[worker].second.get();
+        HotspotStats* stats = getWorkerStats(statsCollector, worker);
+        unsigned int ticketCounter = 0;
+
+        for (std::size_t i = from; i < to; i ++) {
+            results[i] = handleQueryLine(batch[i], network, ticketCounter, queryCache, scratch, profile, stats);
+        }
+
+        return ticketCounter;
+    }
+
+    // Query worker - evaluates the tasks handed to it, handing every one back once done, until a null one.
+    void runQueryWorker(TaskQueue& tasks, TaskQueue& doneTasks, std::size_t worker) {
+        while (QueryTask* task = popBatch(tasks)) {
+            auto& [run, from, to, profile, ticketCounter] = *task;
+            ticketCounter = evaluateQueryRange(*run, from, to, worker, profile);
+            pushBatch(doneTasks, task);
+        }
+    }
+
+    void stopQueryWorkers(QueryWorkerPool* queryWorkerPool) {
+        auto& [taskQueues, doneQueues, tasks, threads] = *queryWorkerPool;
+
+        for (auto& taskQueue : taskQueues) {
+            pushBatch<QueryTask>(taskQueue, nullptr);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        delete queryWorkerPool;
+    }
+
+    // Starts the workers once, so that a run of queries only hands them their tasks. The thread handling the batches
+    // is worker 0, so workerCount - 1 threads are started.
+    QueryWorkers createQueryWorkers(unsigned int workerCount) {
+        QueryWorkers queryWorkers(new QueryWorkerPool(), stopQueryWorkers);
+        auto& [taskQueues, doneQueues, tasks, threads] = *queryWorkers;
+
+        tasks.resize(workerCount - 1);
+        for (unsigned int worker = 1; worker < workerCount; worker ++) {
+            TaskQueue& taskQueue = taskQueues.emplace_back(std::vector<QueryTask*>(batchQueueSize), 0, 0);
+            TaskQueue& doneQueue = doneQueues.emplace_back(std::vector<QueryTask*>(batchQueueSize), 0, 0);
+            threads.emplace_back(runQueryWorker, std::ref(taskQueue), std::ref(doneQueue), worker);
+        }
+
+        return queryWorkers;
+    }
+
+    inline unsigned int getQueryWorkerCount(const QueryWorkers& queryWorkers) {
+        return static_cast<unsigned int>(std::get<std::vector<std::thread>>(*queryWorkers).size() + 1);
+    }
+
+    // Evaluates a run of queries, none of which changes the network, split evenly among the workers.
+    // Returns the number of tickets proposed.
+    unsigned int evaluateQueries(const InputBatch& batch, std::size_t begin, std::size_t end, const Network& network,
+            QueryWorkers& queryWorkers, std::vector<ProcessResult>& results, std::vector<QueryCache>& queryCaches,
+            std::vector<ScratchArena>& scratchArenas, Profile* profile, StatsCollector* statsCollector) {
+        QueryRun run(batch, network, results, queryCaches, scratchArenas, statsCollector);
+        std::size_t queryCount = end - begin;
+        std::size_t usedWorkerCount = std::min<std::size_t>(getQueryWorkerCount(queryWorkers),
+                queryCount / minQueriesPerWorker);
+        if (usedWorkerCount <= 1) {
+            return evaluateQueryRange(run, begin, end, 0, profile);
+        }
+
+        // Workers profile on their own and are merged afterwards.
+        auto& [taskQueues, doneQueues, tasks, threads] = *queryWorkers;
+        std::vector<Profile> workerProfiles(profile != nullptr ? usedWorkerCount - 1 : 0);
+        for (std::size_t worker = 1; worker < usedWorkerCount; worker ++) {
+            Profile* workerProfile = (profile != nullptr) ? &workerProfiles[worker - 1] : nullptr;
+            tasks[worker - 1] = QueryTask(&run, begin + queryCount * worker / usedWorkerCount,
+                    begin + queryCount * (worker + 1) / usedWorkerCount, workerProfile, 0);
+            pushBatch(taskQueues[worker - 1], &tasks[worker - 1]);
+        }
+
+        unsigned int ticketCounter = evaluateQueryRange(run, begin, begin + queryCount / usedWorkerCount, 0, profile);
+        for (std::size_t worker = 1; worker < usedWorkerCount; worker ++) {
+            ticketCounter += std::get<4>(*popBatch(doneQueues[worker - 1]));
+        }
+        for (const auto& workerProfile : workerProfiles) {
+            mergeProfile(*profile, workerProfile);
+        }
+
+        return ticketCounter;
+    }
+
+    // Processes a batch of lines as if one by one. Additions of routes and tickets are applied in order, and every
+    // run of queries between them is evaluated in parallel against the network as of that run. Every worker uses
+    // its own query cache, if there are any, its own scratch arena, which the results point into, and its own
+    // statistics, if collected.
+    void processBatch(const InputBatch& batch, Network& network, QueryWorkers& queryWorkers,
+            std::vector<ProcessResult>& results, unsigned int& ticketCounter, std::vector<QueryCache>& queryCaches,
+            std::vector<ScratchArena>& scratchArenas, Profile* profile, StatsCollector* statsCollector) {
+        results.clear();
+        results.resize(batch.size());
+        std::size_t runBegin = 0;
+
+        for (std::size_t i = 0; i < batch.size(); i ++) {
+            if (isReadOnlyRequest(getRequestType(batch[i]))) {
+                continue;
+            }
+
+            ticketCounter += evaluateQueries(batch, runBegin, i, network, queryWorkers, results, queryCaches,
+                    scratchArenas, profile, statsCollector);
+            runBegin = i + 1;
+
+            results[i] = handleLine(batch[i], network, ticketCounter, scratchArenas[0].second.get(), profile);
+        }
+
+        ticketCounter += evaluateQueries(batch, runBegin, batch.size(), network, queryWorkers, results, queryCaches,
+                scratchArenas, profile, statsCollector);
+    }
+
+    inline void flushChannel(OutputChannel& channel) {
+        auto& [stream, pending] = channel;
+
+        if (! pending.empty()) {
+            stream->write(pending.data(), pending.size());
+            stream->flush();
+            pending.clear();
+        }
+    }
+
+    void flushOutput(Output& output) {
+        for (auto& channel : std::get<0>(output)) {
+            flushChannel(channel);
+        }
+    }
+
+    Output createOutput(bool lineBuffered) {
+        Output output = {{OutputChannel(&std::cout, ""), OutputChannel(&std::cerr, "")}, lineBuffered, ""};
+
+        for (auto& channel : std::get<0>(output)) {
+            channel.second.reserve(outputFlushThreshold);
+        }
+
+        return output;
+    }
+
+    // Returns the buffer to format a response line into, already holding the output's tag. Pending bytes of the
+    // other stream are written out first, so that the streams interleave exactly as if every line were flushed.
+    std::string& beginResponse(Output& output, OutputStream stream) {
+        auto& [channels, lineBuffered, tag] = output;
+        flushChannel(channels[stream == STDOUT ? STDERR : STDOUT]);
+        return channels[stream].second += tag;
+    }
+
+    inline void endResponse(Output& output, OutputStream stream) {
+        auto& [channels, lineBuffered, tag] = output;
+        auto& channel = channels[stream];
+
+        if (lineBuffered || channel.second.size() >= outputFlushThreshold) {
+            flushChannel(channel);
+        }
+    }
+
+    inline void appendNumber(std::string& buffer, unsigned int number) {
+        std::array<char, std::numeric_limits<unsigned int>::digits10 + 1> digits;
+        auto end = std::to_chars(digits.begin(), digits.end(), number).ptr;
+        buffer.append(digits.begin(), end);
+    }
+
+    void appendTickets(std::string& buffer, const SelectedTickets& tickets) {
+        bool first = true;
+
+        for (auto it = tickets.crbegin(); it != tickets.crend(); it++) {
+            if (! first) {
+                buffer += "; ";
+            } else {
+                first = false;
+            }
+
+            buffer += it->first;
+        }
+    }
+
+    void printFound(const SelectedTickets& tickets, Output& output) {
+        std::string& buffer = beginResponse(output, STDOUT);
+
+        buffer += "! ";
+        appendTickets(buffer, tickets);
+        buffer += '\n';
+
+        endResponse(output, STDOUT);
+    }
+
+    // Prints "! untagged tickets @tag tickets @tag tickets", leaving out fare classes without a set. Untagged tickets
+    // alone are printed just as by printFound.
+    void printFoundFares(const FareTickets& fareTickets, Output& output) {
+        std::string& buffer = beginResponse(output, STDOUT);
+
+        buffer += '!';
+        for (const auto& [fareClass, tickets] : fareTickets) {
+            if (! fareClass.empty()) {
+                buffer += " @";
+                buffer += fareClass;
+            }
+            buffer += ' ';
+            appendTickets(buffer, tickets);
+        }
+        buffer += '\n';
+
+        endResponse(output, STDOUT);
+    }
+
+    void printWait(std::string_view stop, Output& output) {
+        std::string& buffer = beginResponse(output, STDOUT);
+
+        buffer += ":-( ";
+        buffer += stop;
+        buffer += '\n';
+
+        endResponse(output, STDOUT);
+    }
+
+    void printNotFound(Output& output) {
+        beginResponse(output, STDOUT) += ":-|\n";
+        endResponse(output, STDOUT);
+    }
+
+    void printError(std::string_view inputLine, unsigned int lineCounter, Output& output) {
+        std::string& buffer = beginResponse(output, STDERR);
+
+        buffer += "Error in line ";
+        appendNumber(buffer, lineCounter);
+        buffer += ": ";
+        buffer += inputLine;
+        buffer += '\n';
+
+        endResponse(output, STDERR);
+    }
+
+    // Prints the journey in the form of a query, followed by the tickets for it.
+    void printPlanned(const PlannedJourney& plannedJourney, Output& output) {
+        const auto& [journey, tickets] = plannedJourney;
+        std::string& buffer = beginResponse(output, STDOUT);
+
+        buffer += '>';
+        for (const auto& [stopName, lineNum, stopId] : journey) {
+            buffer += ' ';
+            buffer += stopName;
+            if (lineNum != 0) {
+                buffer += ' ';
+                buffer += std::to_string(lineNum);
+            }
+        }
+        buffer += '\n';
+
+        endResponse(output, STDOUT);
+
+        if (tickets.empty()) {
+            printNotFound(output);
+        } else {
+            printFound(tickets, output);
+        }
+    }
+
+    void printOutput(const ProcessResult& processResult, std::string_view inputLine, unsigned int lineCounter,
+            Output& output) {
+        switch (processResult.first) {
+            case FOUND:
+                return printFound(std::get<SelectedTickets>(processResult.second.value()), output);
+            case FOUND_FARES:
+                return printFoundFares(std::get<FareTickets>(processResult.second.value()), output);
+            case PLANNED:
+                return printPlanned(std::get<PlannedJourney>(processResult.second.value()), output);
+            case WAIT:
+                return printWait(std::get<std::string_view>(processResult.second.value()), output);
+            case NOT_FOUND:
+                return printNotFound(output);
+            case NO_RESPONSE:
+                break;
+            case ERROR_RESP:
+                return printError(inputLine, lineCounter, output);
+        }
+    }
+
+    void printTicketCount(unsigned int ticketCounter, Output& output) {
+        std::string& buffer = beginResponse(output, STDOUT);
+
+        appendNumber(buffer, ticketCounter);
+        buffer += '\n';
+
+        endResponse(output, STDOUT);
+    }
+
+    const char* findNewlineScalar(const char* begin, const char* end) {
+        const void* found = std::memchr(begin, '\n', end - begin);
+        return (found != nullptr) ? static_cast<const char*>(found) : end;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse2")))
+    const char* findNewlineSse2(const char* begin, const char* end) {
+        const __m128i newlines = _mm_set1_epi8('\n');
+
+        for (; end - begin >= 16; begin += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newlines));
+            if (mask != 0) {
+                return begin + __builtin_ctz(mask);
+            }
+        }
+
+        return findNewlineScalar(begin, end);
+    }
+
+    __attribute__((target("avx2")))
+    const char* findNewlineAvx2(const char* begin, const char* end) {
+        const __m256i newlines = _mm256_set1_epi8('\n');
+
+        for (; end - begin >= 32; begin += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+            auto mask = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newlines)));
+            if (mask != 0) {
+                return begin + __builtin_ctz(mask);
+            }
+        }
+
+        return findNewlineSse2(begin, end);
+    }
+#endif
+
+    // Picks the widest newline scan the CPU supports.
+    NewlineFinder selectNewlineFinder() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return findNewlineAvx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            return findNewlineSse2;
+        }
+#endif
+        return findNewlineScalar;
+    }
+
+    // Maps a regular file, the rest of it starting at the descriptor's offset.
+    std::optional<MappedInput> mapInputFile(int fd) {
+        struct stat status;
+        if (fstat(fd, &status) != 0 || ! S_ISREG(status.st_mode) || status.st_size == 0) {
+            return std::nullopt;
+        }
+
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset < 0) {
+            return std::nullopt;
+        }
+
+        auto size = static_cast<std::size_t>(status.st_size);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            return std::nullopt;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        std::string_view file(static_cast<const char*>(data), size);
+        return MappedInput(file, file.substr(std::min(static_cast<std::size_t>(offset), size)));
+    }
+
+    inline void unmapInput(const MappedInput& mappedInput) {
+        munmap(const_cast<char*>(mappedInput.first.data()), mappedInput.first.size());
+    }
+
+    // Moves complete lines from the front of the input to the batch, just as std::getline would split them.
+    void splitInputLines(std::string_view& input, InputBatch& batch, std::size_t maxLineCount) {
+        static const NewlineFinder findNewline = selectNewlineFinder();
+
+        while (batch.size() < maxLineCount && ! input.empty()) {
+            const char* end = input.data() + input.size();
+            const char* newline = findNewline(input.data(), end);
+            if (newline == end) {
+                break;
+            }
+
+            auto length = static_cast<std::size_t>(newline - input.data());
+            batch.push_back(input.substr(0, length));
+            input.remove_prefix(length + 1);
+        }
+    }
+
+    // Hands the input to the handler in batches of lines. The lines point into the mapping or into the read
+    // buffer, so they stay valid only until the handler returns. A streamed batch holds whatever a single read
+    // delivered, so interactive input is answered right away.
+    template<typename BatchHandler>
+    void forEachInputBatch(bool allowMapping, BatchHandler handleBatch) {
+        InputBatch batch;
+        auto mappedInput = allowMapping ? mapInputFile(STDIN_FILENO) : std::nullopt;
+
+        if (mappedInput.has_value()) {
+            std::string_view input = mappedInput.value().second;
+
+            while (! input.empty()) {
+                batch.clear();
+                splitInputLines(input, batch, inputBatchSize);
+                if (batch.empty()) {
+                    // The last line does not end with a newline.
+                    batch.push_back(input);
+                    input = {};
+                }
+                handleBatch(batch);
+            }
+
+            unmapInput(mappedInput.value());
+            return;
+        }
+
+        std::string buffer;
+        while (true) {
+            std::size_t kept = buffer.size();
+            buffer.resize(kept + inputChunkSize);
+
+            ssize_t count = read(STDIN_FILENO, buffer.data() + kept, inputChunkSize);
+            if (count < 0 && errno == EINTR) {
+                buffer.resize(kept);
+                continue;
+            }
+            buffer.resize(kept + std::max<ssize_t>(count, 0));
+
+            std::string_view input = buffer;
+            batch.clear();
+            if (count <= 0) {
+                if (! input.empty()) {
+                    batch.push_back(input);
+                    handleBatch(batch);
+                }
+                return;
+            }
+
+            splitInputLines(input, batch, SIZE_MAX);
+            if (! batch.empty()) {
+                handleBatch(batch);
+            }
+            buffer.erase(0, buffer.size() - input.size());
+        }
+    }
+
+    // Reads a checkpoint record - "# lines tickets" - of a journal.
+    std::optional<SnapshotCounters> readJournalCheckpoint(std::string_view record) {
+        std::size_t pos = 0;
+        if (! scanChar(record, pos, '#') || ! scanChar(record, pos, ' ')) {
+            return std::nullopt;
+        }
+
+        auto lineCount = getNumber(scanWhile(record, pos, isDigitChar));
+        if (! scanChar(record, pos, ' ')) {
+            return std::nullopt;
+        }
+        auto ticketCount = getNumber(scanWhile(record, pos, isDigitChar));
+        if (! lineCount.has_value() || ! ticketCount.has_value() || pos != record.size()
+                || lineCount.value() > UINT_MAX || ticketCount.value() > UINT_MAX) {
+            return std::nullopt;
+        }
+
+        return SnapshotCounters(lineCount.value(), ticketCount.value());
+    }
+
+    // Replays the routes and tickets a journal has recorded before its last checkpoint, taking the checkpoint's
+    // counters. Returns the length of the journal up to that checkpoint - records after it (and a record cut short
+    // by a crash) were never checkpointed, so their input is handled again.
+    std::optional<std::size_t> replayJournal(std::string_view journal, Network& network,
+            SnapshotCounters& counters) {
+        if (journal.substr(0, journalHeader.size()) != journalHeader) {
+            return std::nullopt;
+        }
+
+        std::string_view records = journal.substr(journalHeader.size());
+        std::size_t checkpointedLength = 0;
+        for (std::size_t pos = 0, end; (end = records.find('\n', pos)) != std::string_view::npos; pos = end + 1) {
+            std::string_view record = records.substr(pos, end - pos);
+            if (! record.empty() && record[0] == '#') {
+                auto checkpoint = readJournalCheckpoint(record);
+                if (! checkpoint.has_value()) {
+                    return std::nullopt;
+                }
+                counters = checkpoint.value();
+                checkpointedLength = end + 1;
+            }
+        }
+
+        std::array<char, 1 << 12> buffer;
+        std::pmr::monotonic_buffer_resource scratch(buffer.data(), buffer.size());
+        unsigned int ticketCounter = 0;
+        for (std::size_t pos = 0, end; pos < checkpointedLength; pos = end + 1) {
+            end = records.find('\n', pos);
+            std::string_view record = records.substr(pos, end - pos);
+            if (record[0] == '#') {
+                continue;
+            }
+
+            // Only accepted requests are recorded, so anything else means the journal belongs to another network.
+            ParseResult parseResult = parseInputLine(record, network, &scratch);
+            if (! isNetworkChange(parseResult.first)
+                    || processRequest(parseResult, network, ticketCounter, &scratch).first != NO_RESPONSE) {
+                return std::nullopt;
+            }
+            scratch.release();
+        }
+
+        return journalHeader.size() + checkpointedLength;
+    }
+
+    // Opens the journal, creating it if needed, and replays whatever it has recorded into the network, updating the
+    // counters to those of its last checkpoint.
+    std::optional<Journal> openJournal(const char* path, Clock::duration syncInterval, Network& network,
+            SnapshotCounters& counters) {
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return std::nullopt;
+        }
+
+        auto mappedJournal = mapInputFile(fd);
+        std::optional<std::size_t> length = journalHeader.size();
+        if (mappedJournal.has_value()) {
+            length = replayJournal(mappedJournal.value().first, network, counters);
+            unmapInput(mappedJournal.value());
+        } else if (! writeAll(fd, journalHeader)) {
+            length = std::nullopt;
+        }
+
+        if (! length.has_value() || ftruncate(fd, static_cast<off_t>(length.value())) != 0
+                || lseek(fd, 0, SEEK_END) < 0 || fdatasync(fd) != 0) {
+            close(fd);
+            return std::nullopt;
+        }
+
+        return Journal(fd, "", Clock::now(), syncInterval, true);
+    }
+
+    inline void writeJournal(Journal& journal) {
+        auto& [fd, pending, lastSync, syncInterval, healthy] = journal;
+
+        healthy = writeAll(fd, pending) && healthy;
+        pending.clear();
+    }
+
+    // Records the routes and tickets accepted in a batch. Records are written in bulk and synced only with
+    // checkpoints, so the journal costs little more than a copy of those lines.
+    void journalBatch(Journal& journal, const InputBatch& batch, const std::vector<ProcessResult>& results) {
+        std::string& pending = std::get<std::string>(journal);
+
+        for (std::size_t i = 0; i < batch.size(); i ++) {
+            RequestType requestType = (results[i].first == NO_RESPONSE) ? getRequestType(batch[i]) : IGNORE;
+            if (isNetworkChange(requestType)) {
+                pending += batch[i];
+                pending += '\n';
+            }
+        }
+
+        if (pending.size() >= journalWriteThreshold) {
+            writeJournal(journal);
+        }
+    }
+
+    // Records that the input has been handled up to the counters, once the sync interval has passed since the last
+    // checkpoint (or right away if forced). The output is flushed first, so that a run resumed from the checkpoint
+    // does not miss any response.
+    void checkpointJournal(Journal& journal, const SnapshotCounters& counters, Output& output, bool force) {
+        auto& [fd, pending, lastSync, syncInterval, healthy] = journal;
+        Clock::time_point now = Clock::now();
+        if (! force && now - lastSync < syncInterval) {
+            return;
+        }
+
+        flushOutput(output);
+        pending += "# ";
+        appendNumber(pending, counters.first);
+        pending += ' ';
+        appendNumber(pending, counters.second);
+        pending += '\n';
+
+        writeJournal(journal);
+        healthy = (fdatasync(fd) == 0) && healthy;
+        lastSync = now;
+    }
+
+    // Closes the journal, returning whether everything has been recorded.
+    bool closeJournal(Journal& journal) {
+        writeJournal(journal);
+        return (close(std::get<int>(journal)) == 0 && std::get<bool>(journal));
+    }
+
+    inline BatchQueue& addBatchQueue(std::deque<BatchQueue>& queues) {
+        return queues.emplace_back(std::vector<PipelineBatch*>(batchQueueSize), 0, 0);
+    }
+
+    // Gives every batch an arena of its own and puts it in the queue of free batches.
+    void addFreeBatches(std::vector<PipelineBatch>& batches, BatchQueue& freeBatches) {
+        std::vector<ScratchArena> scratchArenas = createScratchArenas(batches.size());
+        for (std::size_t i = 0; i < batches.size(); i ++) {
+            std::get<ScratchArena>(batches[i]) = std::move(scratchArenas[i]);
+            pushBatch(freeBatches, &batches[i]);
+        }
+    }
+
+    // Clears a printed batch for reuse. The results point into the arena, so they go first.
+    void releasePipelineBatch(PipelineBatch& batch) {
+        std::get<std::vector<ProcessResult>>(batch).clear();
+        std::get<std::vector<ParseResult>>(batch).clear();
+        std::get<ScratchArena>(batch).second->release();
+    }
+
+    // Copies the lines into the batch, as the reader reuses the input they point into.
+    void fillPipelineBatch(PipelineBatch& batch, const InputBatch& lines) {
+        std::string& text = std::get<std::string>(batch);
+        InputBatch& batchLines = std::get<InputBatch>(batch);
+
+        text.clear();
+        for (auto line : lines) {
+            text += line;
+        }
+
+        batchLines.clear();
+        std::size_t pos = 0;
+        for (auto line : lines) {
+            batchLines.push_back(std::string_view(text).substr(pos, line.size()));
+            pos += line.size();
+        }
+    }
+
+    // Parser of the pipeline - scans the lines of every batch it gets, which needs nothing but the lines and (a copy
+    // of) the service window.
+    void scanPipelineBatches(BatchQueue& input, BatchQueue& output, ServiceWindow serviceWindow, Profile* profile) {
+        while (PipelineBatch* batch = popBatch(input)) {
+            std::pmr::memory_resource* scratch = std::get<ScratchArena>(*batch).second.get();
+            auto& parseResults = std::get<std::vector<ParseResult>>(*batch);
+
+            Clock::time_point start = startTiming(profile);
+            for (auto line : std::get<InputBatch>(*batch)) {
+                parseResults.push_back(scanInputLine(line, serviceWindow, scratch));
+            }
+            recordPhase(profile, PHASE_PARSE, start);
+
+            pushBatch(output, batch);
+        }
+
+        pushBatch<PipelineBatch>(output, nullptr);
+    }
+
+    // Processor of the pipeline - resolves and processes the lines in input order, taking the batches from the
+    // parsers in the same round-robin order the reader handed them out in. Resolving counts as processing. Being the
+    // only thread to collect statistics, it also writes the reports asked for.
+    void processPipelineBatches(std::deque<BatchQueue>& parserOutputs, BatchQueue& output, Network& network,
+            unsigned int& ticketCounter, Profile* profile, StatsCollector* statsCollector) {
+        HotspotStats* stats = getWorkerStats(statsCollector, 0);
+
+        for (std::size_t parser = 0; ; parser = (parser + 1) % parserOutputs.size()) {
+            PipelineBatch* batch = popBatch(parserOutputs[parser]);
+            if (batch == nullptr) {
+                break;
+            }
+
+            std::pmr::memory_resource* scratch = std::get<ScratchArena>(*batch).second.get();
+            auto& parseResults = std::get<std::vector<ParseResult>>(*batch);
+            auto& processResults = std::get<std::vector<ProcessResult>>(*batch);
+
+            for (auto& parseResult : parseResults) {
+                Clock::time_point start = startTiming(profile);
+                resolveRequest(parseResult, network);
+                processResults.push_back(processRequest(parseResult, network, ticketCounter, scratch));
+                if (parseResult.first == QUERY) {
+                    recordQueryStats(stats, std::get<Query>(parseResult.second.value()), processResults.back(),
+                            network);
+                } else if (parseResult.first == PLAN) {
+                    recordResponseStats(stats, processResults.back(), network);
+                }
+                recordLine(profile, parseResult.first, start, start);
+            }
+            writeRequestedStats(statsCollector, network);
+
+            pushBatch(output, batch);
+        }
+
+        pushBatch<PipelineBatch>(output, nullptr);
+    }
+
+    // Writer of the pipeline - prints the responses of every batch, journals it (if there is a journal) and hands
+    // the batch back to the reader. The processor runs ahead, so the writer counts the tickets printed on its own.
+    void printPipelineBatches(BatchQueue& input, BatchQueue& freeBatches, Output& output, unsigned int& lineCounter,
+            unsigned int printedTicketCounter, Journal* journal, Profile* profile) {
+        while (PipelineBatch* batch = popBatch(input)) {
+            const InputBatch& lines = std::get<InputBatch>(*batch);
+            auto& processResults = std::get<std::vector<ProcessResult>>(*batch);
+
+            Clock::time_point start = startTiming(profile);
+            for (std::size_t i = 0; i < lines.size(); i ++) {
+                printOutput(processResults[i], lines[i], lineCounter, output);
+                printedTicketCounter += getProposedTicketCount(processResults[i]);
+                lineCounter ++;
+            }
+            recordPhase(profile, PHASE_PRINT, start);
+
+            if (journal != nullptr) {
+                journalBatch(*journal, lines, processResults);
+                checkpointJournal(*journal, SnapshotCounters(lineCounter - 1, printedTicketCounter), output, false);
+            }
+
+            releasePipelineBatch(*batch);
+            pushBatch(freeBatches, batch);
+        }
+    }
+
+    // Runs the input through a pipeline: the calling thread reads batches and hands them out to the parsers in
+    // turn, the parsers scan them in parallel, a single processor applies them to the network in input order and
+    // a writer prints the responses. The threads pass batches along lock-free queues, and a fixed set of batches
+    // circulates among them. Responses are exactly those of handling the lines one by one.
+    template<typename ForEachBatch>
+    void runPipeline(ForEachBatch forEachBatch, unsigned int parserCount, Network& network,
+            unsigned int& ticketCounter, unsigned int& lineCounter, Output& output, Journal* journal,
+            Profile* profile, StatsCollector* statsCollector) {
+        // The processor starts changing the counter right away.
+        unsigned int initialTicketCounter = ticketCounter;
+        std::vector<PipelineBatch> batches(pipelineBatchCount);
+        BatchQueue freeBatches(std::vector<PipelineBatch*>(batchQueueSize), 0, 0);
+        addFreeBatches(batches, freeBatches);
+
+        // Parsers and the writer profile on their own and are merged afterwards.
+        std::vector<Profile> stageProfiles(profile != nullptr ? parserCount + 1 : 0);
+        auto getStageProfile = [&stageProfiles](std::size_t stage) {
+            return stageProfiles.empty() ? nullptr : &stageProfiles[stage];
+        };
+
+        std::deque<BatchQueue> parserInputs, parserOutputs;
+        std::vector<std::thread> threads;
+        for (unsigned int parser = 0; parser < parserCount; parser ++) {
+            threads.emplace_back(scanPipelineBatches, std::ref(addBatchQueue(parserInputs)),
+                    std::ref(addBatchQueue(parserOutputs)), std::get<ServiceWindow>(network), getStageProfile(parser));
+        }
+        BatchQueue printInput(std::vector<PipelineBatch*>(batchQueueSize), 0, 0);
+        threads.emplace_back(processPipelineBatches, std::ref(parserOutputs), std::ref(printInput), std::ref(network),
+                std::ref(ticketCounter), profile, statsCollector);
+        threads.emplace_back(printPipelineBatches, std::ref(printInput), std::ref(freeBatches), std::ref(output),
+                std::ref(lineCounter), initialTicketCounter, journal, getStageProfile(parserCount));
+
+        std::size_t parser = 0;
+        forEachBatch([&](const InputBatch& lines) {
+            PipelineBatch* batch = popBatch(freeBatches);
+            fillPipelineBatch(*batch, lines);
+            pushBatch(parserInputs[parser], batch);
+            parser = (parser + 1) % parserCount;
+        });
+        for (auto& parserInput : parserInputs) {
+            pushBatch<PipelineBatch>(parserInput, nullptr);
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (const auto& stageProfile : stageProfiles) {
+            for (std::size_t phase = 0; phase < phaseCount; phase ++) {
+                std::get<2>(*profile)[phase] += std::get<2>(stageProfile)[phase];
+            }
+        }
+    }
+
+    // Hands the input to the handler just as forEachInputBatch does, leaving out its first skippedLineCount lines
+    // (those an interrupted run has already handled).
+    template<typename BatchHandler>
+    void forEachRemainingBatch(bool allowMapping, std::size_t skippedLineCount, BatchHandler handleBatch) {
+        InputBatch remaining;
+
+        forEachInputBatch(allowMapping, [&](const InputBatch& batch) {
+            if (skippedLineCount == 0) {
+                handleBatch(batch);
+            } else if (skippedLineCount >= batch.size()) {
+                skippedLineCount -= batch.size();
+            } else {
+                remaining.assign(batch.begin() + skippedLineCount, batch.end());
+                skippedLineCount = 0;
+                handleBatch(remaining);
+            }
+        });
+    }
+
+    // Shard of the network a line is meant for - that of the network named by its "[name] " tag, which is cut off,
+    // or the default network's for a line without the tag of a known network.
+    std::size_t findLineShard(std::string_view& line, const ShardIndex& shardIndex) {
+        if (line.empty() || line[0] != '[') {
+            return 0;
+        }
+
+        std::size_t tagEnd = line.find("] ");
+        if (tagEnd == std::string_view::npos) {
+            return 0;
+        }
+        auto it = shardIndex.find(line.substr(1, tagEnd - 1));
+        if (it == shardIndex.end()) {
+            return 0;
+        }
+
+        line.remove_prefix(tagEnd + 2);
+        return it->second;
+    }
+
+    // Processor of a shard - handles the lines of every batch it gets in order, on the network it alone owns.
+    void processShardBatches(BatchQueue& input, BatchQueue& output, Network& network, unsigned int& ticketCounter) {
+        while (PipelineBatch* batch = popBatch(input)) {
+            std::pmr::memory_resource* scratch = std::get<ScratchArena>(*batch).second.get();
+            auto& processResults = std::get<std::vector<ProcessResult>>(*batch);
+
+            for (auto line : std::get<InputBatch>(*batch)) {
+                processResults.push_back(handleLine(line, network, ticketCounter, scratch, nullptr));
+            }
+
+            pushBatch(output, batch);
+        }
+
+        pushBatch<PipelineBatch>(output, nullptr);
+    }
+
+    // Writer of a sharded run with merged output - prints the responses of all the shards in input order, as the
+    // routings tell, every one tagged with its network's tag. Batches go back to the free batches of their shards
+    // once printed, and routings back to the reader.
+    void printShardBatches(RoutingQueue& routings, RoutingQueue& freeRoutings, std::deque<BatchQueue>& shardOutputs,
+            std::deque<BatchQueue>& freeBatches, const std::vector<std::string>& tags,
+            std::vector<unsigned int>& lineCounters, Output& output) {
+        std::vector<PipelineBatch*> printedBatches(shardOutputs.size(), nullptr);
+        std::vector<std::size_t> printedLineCounts(shardOutputs.size(), 0);
+
+        while (ShardRouting* routing = popBatch(routings)) {
+            for (std::size_t shard : *routing) {
+                if (printedBatches[shard] == nullptr) {
+                    printedBatches[shard] = popBatch(shardOutputs[shard]);
+                    printedLineCounts[shard] = 0;
+                }
+
+                PipelineBatch& batch = *printedBatches[shard];
+                std::size_t i = printedLineCounts[shard] ++;
+                std::get<std::string_view>(output) = tags[shard];
+                printOutput(std::get<std::vector<ProcessResult>>(batch)[i], std::get<InputBatch>(batch)[i],
+                        lineCounters[shard] ++, output);
+
+                if (printedLineCounts[shard] == std::get<InputBatch>(batch).size()) {
+                    releasePipelineBatch(batch);
+                    pushBatch(freeBatches[shard], printedBatches[shard]);
+                    printedBatches[shard] = nullptr;
+                }
+            }
+
+            pushBatch(freeRoutings, routing);
+        }
+    }
+
+    // Runs the input through shards, one for the default network and one for every named network: the calling
+    // thread reads batches and routes every line to the shard of its network, whose processor is the only thread
+    // to touch the network, so networks are handled in parallel and every one exactly as if it were alone. With
+    // a single output, one writer merges the responses in input order and tags them; otherwise every network has
+    // an output and a writer of its own. Lines are numbered and tickets counted for every network apart, and the
+    // ticket counts are printed at the end.
+    template<typename ForEachBatch>
+    void runShards(ForEachBatch forEachBatch, const std::vector<std::string_view>& networkNames,
+            std::size_t ticketLimit, ServiceWindow serviceWindow, std::vector<Output>& outputs) {
+        std::size_t shardCount = networkNames.size() + 1;
+        bool merged = (outputs.size() == 1);
+        ShardIndex shardIndex;
+        std::vector<std::string> tags(1);
+        for (auto name : networkNames) {
+            shardIndex.emplace(name, tags.size());
+            tags.push_back("[" + std::string(name) + "] ");
+        }
+
+        // Every network has an arena of its own, so that shards never share an allocator.
+        std::deque<std::pmr::monotonic_buffer_resource> networkArenas(shardCount);
+        std::deque<Network> networks;
+        std::vector<unsigned int> ticketCounters(shardCount, 0), lineCounters(shardCount, 1);
+        std::vector<std::vector<PipelineBatch>> batches(shardCount);
+        std::deque<BatchQueue> shardInputs, shardOutputs, freeBatches;
+        for (std::size_t shard = 0; shard < shardCount; shard ++) {
+            networks.push_back(createNetwork(&networkArenas[shard], ticketLimit, serviceWindow));
+            addBatchQueue(shardInputs);
+            addBatchQueue(shardOutputs);
+            batches[shard].resize(shardBatchCount);
+            addFreeBatches(batches[shard], addBatchQueue(freeBatches));
+        }
+
+        std::vector<ShardRouting> routings(merged ? shardBatchCount : 0);
+        RoutingQueue routingQueue(std::vector<ShardRouting*>(batchQueueSize), 0, 0);
+        RoutingQueue freeRoutings(std::vector<ShardRouting*>(batchQueueSize), 0, 0);
+        for (auto& routing : routings) {
+            pushBatch(freeRoutings, &routing);
+        }
+
+        std::vector<std::thread> threads;
+        for (std::size_t shard = 0; shard < shardCount; shard ++) {
+            threads.emplace_back(processShardBatches, std::ref(shardInputs[shard]), std::ref(shardOutputs[shard]),
+                    std::ref(networks[shard]), std::ref(ticketCounters[shard]));
+            if (! merged) {
+                threads.emplace_back(printPipelineBatches, std::ref(shardOutputs[shard]), std::ref(freeBatches[shard]),
+                        std::ref(outputs[shard]), std::ref(lineCounters[shard]), 0, nullptr, nullptr);
+            }
+        }
+        if (merged) {
+            threads.emplace_back(printShardBatches, std::ref(routingQueue), std::ref(freeRoutings),
+                    std::ref(shardOutputs), std::ref(freeBatches), std::cref(tags), std::ref(lineCounters),
+                    std::ref(outputs[0]));
+        }
+
+        std::vector<InputBatch> shardLines(shardCount);
+        forEachBatch([&](const InputBatch& lines) {
+            ShardRouting* routing = merged ? popBatch(freeRoutings) : nullptr;
+            if (routing != nullptr) {
+                routing->clear();
+            }
+            for (auto& linesOfShard : shardLines) {
+                linesOfShard.clear();
+            }
+
+            for (std::string_view line : lines) {
+                std::size_t shard = findLineShard(line, shardIndex);
+                shardLines[shard].push_back(line);
+                if (routing != nullptr) {
+                    routing->push_back(shard);
+                }
+            }
+
+            for (std::size_t shard = 0; shard < shardCount; shard ++) {
+                if (! shardLines[shard].empty()) {
+                    PipelineBatch* batch = popBatch(freeBatches[shard]);
+                    fillPipelineBatch(*batch, shardLines[shard]);
+                    pushBatch(shardInputs[shard], batch);
+                }
+            }
+            if (routing != nullptr) {
+                pushBatch(routingQueue, routing);
+            }
+        });
+        for (auto& shardInput : shardInputs) {
+            pushBatch<PipelineBatch>(shardInput, nullptr);
+        }
+        if (merged) {
+            pushBatch<ShardRouting>(routingQueue, nullptr);
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (std::size_t shard = 0; shard < shardCount; shard ++) {
+            Output& output = outputs[merged ? 0 : shard];
+            std::get<std::string_view>(output) = merged ? std::string_view(tags[shard]) : std::string_view();
+            printTicketCount(ticketCounters[shard], output);
+        }
+        // The tags are about to go.
+        std::get<std::string_view>(outputs[0]) = std::string_view();
+    }
+
+    // Appends a number to a snapshot in the machine's byte order.
+    template<typename Number>
+    inline void appendSnapshotNumber(std::string& snapshot, Number number) {
+        snapshot.append(reinterpret_cast<const char*>(&number), sizeof(number));
+    }
+
+    inline void appendSnapshotString(std::string& snapshot, std::string_view string) {
+        appendSnapshotNumber<std::uint32_t>(snapshot, static_cast<std::uint32_t>(string.size()));
+        snapshot.append(string);
+    }
+
+    template<typename Number>
+    std::optional<Number> readSnapshotNumber(std::string_view snapshot, std::size_t& pos) {
+        if (snapshot.size() - pos < sizeof(Number)) {
+            return std::nullopt;
+        }
+
+        Number number;
+        std::memcpy(&number, snapshot.data() + pos, sizeof(number));
+        pos += sizeof(number);
+        return number;
+    }
+
+    std::optional<std::string_view> readSnapshotString(std::string_view snapshot, std::size_t& pos) {
+        auto length = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        if (! length.has_value() || snapshot.size() - pos < length.value()) {
+            return std::nullopt;
+        }
+
+        std::string_view string = snapshot.substr(pos, length.value());
+        pos += length.value();
+        return string;
+    }
+
+    // FNV-1a hash of the snapshot's contents.
+    std::uint64_t getSnapshotChecksum(std::string_view snapshot) {
+        std::uint64_t checksum = 0xcbf29ce484222325ull;
+        for (char c : snapshot) {
+            checksum = (checksum ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+        }
+        return checksum;
+    }
+
+    inline void appendSnapshotTicketSet(std::string& snapshot, const TicketSet& ticketSet) {
+        appendSnapshotNumber<SetPrice>(snapshot, ticketSet.first);
+        appendSnapshotNumber<std::uint32_t>(snapshot, static_cast<std::uint32_t>(ticketSet.second.first));
+        for (TicketId id : ticketSet.second.second) {
+            appendSnapshotNumber<TicketId>(snapshot, id);
+        }
+    }
+
+    // Reads a ticket set, rejecting the ones that refer to tickets outside the catalog.
+    bool readSnapshotTicketSet(std::string_view snapshot, std::size_t& pos, std::size_t ticketCount,
+            TicketSet& ticketSet) {
+        auto price = readSnapshotNumber<SetPrice>(snapshot, pos);
+        auto count = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        if (! price.has_value() || ! count.has_value() || count.value() > maxTicketCount) {
+            return false;
+        }
+
+        ticketSet.first = price.value();
+        ticketSet.second.first = count.value();
+        for (std::size_t i = 0; i < maxTicketCount; i ++) {
+            auto id = readSnapshotNumber<TicketId>(snapshot, pos);
+            if (! id.has_value() || (i < count.value() && id.value() >= ticketCount)) {
+                return false;
+            }
+            ticketSet.second.second[i] = id.value();
+        }
+
+        return true;
+    }
+
+    // Serializes the network: the header, the stop names in order of their ids, the routes, the ticket catalog
+    // and the ticket selection table, followed by the checksum of all of that.
+    std::string createSnapshot(const Network& network, const SnapshotCounters& counters) {
+        const auto& [stopIndex, timetable, ticketCatalog, fareClasses, stopVisits, ticketEpoch, serviceWindow]
+            = network;
+        std::string snapshot(snapshotMagic);
+
+        appendSnapshotNumber<std::uint32_t>(snapshot, snapshotVersion);
+        appendSnapshotNumber<std::uint32_t>(snapshot, maxTicketCount);
+        appendSnapshotNumber<std::uint32_t>(snapshot,
+                static_cast<std::uint32_t>(getUntaggedTicketTable(network).first.size()));
+        appendSnapshotNumber<std::uint32_t>(snapshot, static_cast<std::uint32_t>(serviceWindow.first));
+        appendSnapshotNumber<std::uint32_t>(snapshot, static_cast<std::uint32_t>(serviceWindow.second));
+        appendSnapshotNumber<std::uint32_t>(snapshot, counters.first);
+        appendSnapshotNumber<std::uint32_t>(snapshot, counters.second);
+
+        appendSnapshotNumber<std::uint32_t>(snapshot, static_cast<std::uint32_t>(stopIndex.first.size()));
+        for (const auto& stopName : stopIndex.first) {
+            appendSnapshotString(snapshot, stopName);
+        }
+
+        appendSnapshotNumber<std::uint64_t>(snapshot, timetable.first);
+        for (const auto& [lineNum, route] : timetable.second) {
+            if (route.empty()) {
+                continue;
+            }
+            appendSnapshotNumber<LineNum>(snapshot, lineNum);
+            appendSnapshotNumber<std::uint32_t>(snapshot, static_cast<std::uint32_t>(route.size()));
+            for (const auto& [stopId, stopTime] : route) {
+                appendSnapshotNumber<StopId>(snapshot, stopId);
+                appendSnapshotNumber<RouteStopTime>(snapshot, stopTime);
+            }
+        }
+
+        // Fare classes are not stored - tickets are stored with their tags, and the classes come back in order.
+        // Withdrawn tickets are kept, marked, so that ids stay the same.
+        appendSnapshotNumber<std::uint32_t>(snapshot, static_cast<std::uint32_t>(ticketCatalog.size()));
+        for (TicketId id = 0; id < ticketCatalog.size(); id ++) {
+            const auto& [name, price, validTime, fareClassId] = ticketCatalog[id];
+            appendSnapshotString(snapshot, name);
+            appendSnapshotNumber<std::uint64_t>(snapshot, price);
+            appendSnapshotNumber<ValidTime>(snapshot, validTime);
+            appendSnapshotString(snapshot, std::get<0>(fareClasses[fareClassId]));
+            appendSnapshotNumber<std::uint8_t>(snapshot, isTicketWithdrawn(id, ticketCatalog, fareClasses));
+        }
+
+        for (const auto& [fareClass, ticketMap, ticketTable, ticketsByTime] : fareClasses) {
+            for (const auto& layer : ticketTable.first) {
+                for (const auto& ticketSet : layer) {
+                    appendSnapshotTicketSet(snapshot, ticketSet);
+                }
+            }
+            for (const auto& ticketSet : ticketTable.second) {
+                appendSnapshotTicketSet(snapshot, ticketSet);
+            }
+        }
+
+        appendSnapshotNumber<std::uint64_t>(snapshot, getSnapshotChecksum(snapshot));
+        return snapshot;
+    }
+
+    // Accepts only snapshots of a network with the same ticket limit and service window.
+    bool readSnapshotHeader(std::string_view snapshot, std::size_t& pos, std::size_t ticketLimit,
+            const ServiceWindow& serviceWindow, SnapshotCounters& counters) {
+        if (snapshot.substr(0, snapshotMagic.size()) != snapshotMagic) {
+            return false;
+        }
+        pos = snapshotMagic.size();
+
+        auto version = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        auto ticketCount = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        auto layerCount = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        auto serviceStart = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        auto serviceEnd = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        auto lineCount = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        auto ticketCounter = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        if (! version.has_value() || ! ticketCount.has_value() || ! layerCount.has_value()
+                || ! serviceStart.has_value() || ! serviceEnd.has_value() || ! lineCount.has_value()
+                || ! ticketCounter.has_value() || version.value() != snapshotVersion
+                || ticketCount.value() != maxTicketCount || layerCount.value() != ticketLimit
+                || ServiceWindow(serviceStart.value(), serviceEnd.value()) != serviceWindow) {
+            return false;
+        }
+
+        counters = SnapshotCounters(lineCount.value(), ticketCounter.value());
+        return true;
+    }
+
+    bool readSnapshotStops(std::string_view snapshot, std::size_t& pos, StopIndex& stopIndex) {
+        auto stopCount = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        if (! stopCount.has_value()) {
+            return false;
+        }
+
+        for (std::uint32_t i = 0; i < stopCount.value(); i ++) {
+            auto stopName = readSnapshotString(snapshot, pos);
+            if (! stopName.has_value() || internStop(stopName.value(), stopIndex) != i) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // The stop visits are not stored, but indexed anew.
+    bool readSnapshotRoutes(std::string_view snapshot, std::size_t& pos, StopId stopCount, Timetable& timetable,
+            StopVisits& stopVisits) {
+        auto routeCount = readSnapshotNumber<std::uint64_t>(snapshot, pos);
+        if (! routeCount.has_value()) {
+            return false;
+        }
+
+        for (std::uint64_t i = 0; i < routeCount.value(); i ++) {
+            auto lineNum = readSnapshotNumber<LineNum>(snapshot, pos);
+            auto routeStopCount = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+            if (! lineNum.has_value() || ! routeStopCount.has_value() || routeStopCount.value() == 0
+                    || isLineRepeated(lineNum.value(), timetable)
+                    || (snapshot.size() - pos) / (sizeof(StopId) + sizeof(RouteStopTime)) < routeStopCount.value()) {
+                return false;
+            }
+
+            Route route(routeStopCount.value(), timetable.second.get_allocator());
+            for (auto& [stopId, stopTime] : route) {
+                stopId = readSnapshotNumber<StopId>(snapshot, pos).value();
+                stopTime = readSnapshotNumber<RouteStopTime>(snapshot, pos).value();
+                if (stopId >= stopCount) {
+                    return false;
+                }
+            }
+            indexRoute(lineNum.value(), route, stopVisits);
+            insertRoute(lineNum.value(), std::move(route), timetable);
+        }
+
+        return true;
+    }
+
+    bool readSnapshotTickets(std::string_view snapshot, std::size_t& pos, TicketCatalog& ticketCatalog,
+            FareClasses& fareClasses) {
+        auto ticketCount = readSnapshotNumber<std::uint32_t>(snapshot, pos);
+        if (! ticketCount.has_value()) {
+            return false;
+        }
+
+        for (std::uint32_t i = 0; i < ticketCount.value(); i ++) {
+            auto name = readSnapshotString(snapshot, pos);
+            auto price = readSnapshotNumber<std::uint64_t>(snapshot, pos);
+            auto validTime = readSnapshotNumber<ValidTime>(snapshot, pos);
+            auto tag = readSnapshotString(snapshot, pos);
+            auto withdrawn = readSnapshotNumber<std::uint8_t>(snapshot, pos);
+            if (! name.has_value() || ! price.has_value() || ! validTime.has_value() || ! tag.has_value()
+                    || ! withdrawn.has_value() || withdrawn.value() > 1) {
+                return false;
+            }
+
+            FareClassId fareClassId = addFareClass(tag.value(), fareClasses);
+            TicketMap& ticketMap = std::get<TicketMap>(fareClasses[fareClassId]);
+            if (! withdrawn.value() && isTicketNameRepeated(name.value(), ticketMap)) {
+                return false;
+            }
+
+            ticketCatalog.emplace_back(name.value(), static_cast<Price>(price.value()), validTime.value(), fareClassId);
+            if (! withdrawn.value()) {
+                ticketMap.insert({std::get<0>(ticketCatalog.back()), i});
+                addCoveredTimeTicket(std::get<TicketsByCoveredTime>(fareClasses[fareClassId]), i,
+                        getCoveredTimeLimit(std::get<TicketSelectionTable>(fareClasses[fareClassId])), ticketCatalog);
+            }
+        }
+
+        for (auto& [fareClass, ticketMap, ticketTable, ticketsByTime] : fareClasses) {
+            for (auto& layer : ticketTable.first) {
+                for (auto& ticketSet : layer) {
+                    if (! readSnapshotTicketSet(snapshot, pos, ticketCount.value(), ticketSet)) {
+                        return false;
+                    }
+                }
+            }
+            for (auto& ticketSet : ticketTable.second) {
+                if (! readSnapshotTicketSet(snapshot, pos, ticketCount.value(), ticketSet)) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Restores the network from a snapshot created by createSnapshot, into an empty network with the same ticket
+    // limit.
+    bool readSnapshot(std::string_view snapshot, Network& network, SnapshotCounters& counters) {
+        auto& [stopIndex, timetable, ticketCatalog, fareClasses, stopVisits, ticketEpoch, serviceWindow] = network;
+
+        if (snapshot.size() < sizeof(std::uint64_t)) {
+            return false;
+        }
+        std::size_t checksumPos = snapshot.size() - sizeof(std::uint64_t);
+        auto checksum = readSnapshotNumber<std::uint64_t>(snapshot, checksumPos);
+        snapshot.remove_suffix(sizeof(std::uint64_t));
+        if (checksum.value() != getSnapshotChecksum(snapshot)) {
+            return false;
+        }
+
+        std::size_t pos = 0;
+        return readSnapshotHeader(snapshot, pos, getUntaggedTicketTable(network).first.size(), serviceWindow,
+                counters)
+            && readSnapshotStops(snapshot, pos, stopIndex)
+            && readSnapshotRoutes(snapshot, pos, static_cast<StopId>(stopIndex.first.size()), timetable, stopVisits)
+            && readSnapshotTickets(snapshot, pos, ticketCatalog, fareClasses)
+            && pos == snapshot.size();
+    }
+
+    bool loadSnapshot(const char* path, Network& network, SnapshotCounters& counters) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        auto mappedSnapshot = mapInputFile(fd);
+        close(fd);
+        if (! mappedSnapshot.has_value()) {
+            return false;
+        }
+
+        bool loaded = readSnapshot(mappedSnapshot.value().first, network, counters);
+        unmapInput(mappedSnapshot.value());
+        return loaded;
+    }
+
+    // Writes the snapshot next to the given path and renames it, so that an existing snapshot is replaced only by
+    // a complete one.
+    bool saveSnapshot(const char* path, const Network& network, const SnapshotCounters& counters) {
+        std::string snapshot = createSnapshot(network, counters);
+        std::string temporaryPath = std::string(path) + ".tmp";
+
+        int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+
+        bool saved = writeAll(fd, snapshot) && fsync(fd) == 0;
+        saved = (close(fd) == 0) && saved && rename(temporaryPath.c_str(), path) == 0;
+        if (! saved) {
+            unlink(temporaryPath.c_str());
+        }
+        return saved;
+    }
+
+    // Listens on a fresh Unix domain socket at the path, replacing a stale one.
+    int createServerSocket(const char* path) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (std::strlen(path) >= sizeof(address.sun_path)) {
+            return -1;
+        }
+        std::strcpy(address.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        unlink(path);
+        if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+                || listen(fd, SOMAXCONN) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    // Turns SIGINT and SIGTERM into readable events, so that the server stops between batches.
+    int createSignalFd() {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+
+        if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0) {
+            return -1;
+        }
+        return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+
+    // Both channels of a connection's output write into its response stream, in order.
+    Connection createConnection(int fd) {
+        auto responseStream = std::make_unique<std::ostringstream>();
+        Output output = createOutput(false);
+        for (auto& channel : std::get<0>(output)) {
+            channel.first = responseStream.get();
+        }
+
+        return Connection(fd, std::string(), std::string(), std::move(responseStream), std::move(output), 1, 0,
+                CONNECTION_OPEN);
+    }
+
+    inline bool watchDescriptor(int epollFd, int fd, std::uint32_t events, int operation) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        return (epoll_ctl(epollFd, operation, fd, &event) == 0);
+    }
+
+    // Requests of a client are read only while it keeps up with reading the responses.
+    void updateConnectionEvents(int epollFd, const Connection& connection) {
+        const auto& [fd, input, pendingOutput, responseStream, output, lineCounter, ticketCounter, state] = connection;
+
+        std::uint32_t events = 0;
+        if (state == CONNECTION_OPEN && pendingOutput.size() < connectionOutputLimit) {
+            events |= EPOLLIN;
+        }
+        if (! pendingOutput.empty()) {
+            events |= EPOLLOUT;
+        }
+        watchDescriptor(epollFd, fd, events, EPOLL_CTL_MOD);
+    }
+
+    void acceptConnections(int listenFd, int epollFd, std::unordered_map<int, Connection>& connections) {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+
+            if (! watchDescriptor(epollFd, fd, EPOLLIN, EPOLL_CTL_ADD)) {
+                close(fd);
+                continue;
+            }
+            connections.emplace(fd, createConnection(fd));
+        }
+    }
+
+    // Reads what is available, up to connectionInputLimit bytes; returns false if the connection failed. The socket
+    // stays readable while anything is left in it, so epoll reports it again in the next round.
+    bool receiveRequests(Connection& connection) {
+        auto& [fd, input, pendingOutput, responseStream, output, lineCounter, ticketCounter, state] = connection;
+        std::size_t received = 0;
+
+        while (received < connectionInputLimit) {
+            std::size_t kept = input.size();
+            std::size_t wanted = connectionInputLimit - received;
+            input.resize(kept + wanted);
+
+            ssize_t count = read(fd, input.data() + kept, wanted);
+            input.resize(kept + std::max<ssize_t>(count, 0));
+
+            if (count > 0) {
+                received += static_cast<std::size_t>(count);
+                continue;
+            } else if (count == 0) {
+                state = CONNECTION_INPUT_CLOSED;
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+
+        return true;
+    }
+
+    // Sends as much as the socket takes; returns false if the connection failed.
+    bool sendResponses(Connection& connection) {
+        auto& [fd, input, pendingOutput, responseStream, output, lineCounter, ticketCounter, state] = connection;
+        std::size_t sent = 0;
+
+        while (sent < pendingOutput.size()) {
+            ssize_t count = send(fd, pendingOutput.data() + sent, pendingOutput.size() - sent, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            } else if (count < 0) {
+                pendingOutput.erase(0, sent);
+                return (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+            sent += static_cast<std::size_t>(count);
+        }
+
+        pendingOutput.clear();
+        return true;
+    }
+
+    // Handles the complete lines received from the clients as a single batch, so that queries of all of them are
+    // evaluated in parallel and additions are applied one by one. Every client gets its own line numbers and ticket
+    // count, the latter taken from its responses. A client that closed its input gets the ticket count, just as
+    // the end of the standard input would.
+    void handleRequests(const std::vector<Connection*>& receivedConnections, Network& network,
+            QueryWorkers& queryWorkers, std::vector<QueryCache>& queryCaches, std::vector<ScratchArena>& scratchArenas,
+            Profile* profile, StatsCollector* statsCollector) {
+        InputBatch batch;
+        std::vector<Connection*> lineConnections;
+        std::vector<std::size_t> consumedSizes;
+
+        for (Connection* connection : receivedConnections) {
+            const auto& input = std::get<1>(*connection);
+            std::string_view rest = input;
+
+            splitInputLines(rest, batch, SIZE_MAX);
+            if (std::get<7>(*connection) == CONNECTION_INPUT_CLOSED && ! rest.empty()) {
+                // The last line does not end with a newline.
+                batch.push_back(rest);
+                rest = {};
+            }
+
+            lineConnections.resize(batch.size(), connection);
+            consumedSizes.push_back(input.size() - rest.size());
+        }
+
+        std::vector<ProcessResult> results;
+        unsigned int batchTicketCounter = 0;
+        processBatch(batch, network, queryWorkers, results, batchTicketCounter, queryCaches, scratchArenas, profile,
+                statsCollector);
+
+        Clock::time_point start = startTiming(profile);
+        for (std::size_t i = 0; i < batch.size(); i ++) {
+            auto& [fd, input, pendingOutput, responseStream, output, lineCounter, ticketCounter, state] =
+                *lineConnections[i];
+
+            printOutput(results[i], batch[i], lineCounter, output);
+            lineCounter ++;
+            ticketCounter += getProposedTicketCount(results[i]);
+        }
+        recordPhase(profile, PHASE_PRINT, start);
+
+        releaseScratchArenas(scratchArenas, results);
+
+        for (std::size_t i = 0; i < receivedConnections.size(); i ++) {
+            auto& [fd, input, pendingOutput, responseStream, output, lineCounter, ticketCounter, state] =
+                *receivedConnections[i];
+
+            input.erase(0, consumedSizes[i]);
+            if (state == CONNECTION_INPUT_CLOSED) {
+                printTicketCount(ticketCounter, output);
+                state = CONNECTION_FINISHED;
+            }
+
+            flushOutput(output);
+            pendingOutput += responseStream->str();
+            responseStream->str("");
+        }
+    }
+
+    // Serves clients over the socket until SIGINT or SIGTERM. Returns false if it could not start.
+    bool runServer(const char* path, Network& network, unsigned int workerCount, std::vector<QueryCache>& queryCaches,
+            std::vector<ScratchArena>& scratchArenas, Profile* profile, StatsCollector* statsCollector) {
+        int listenFd = createServerSocket(path);
+        int signalFd = createSignalFd();
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (listenFd < 0 || signalFd < 0 || epollFd < 0 || ! watchDescriptor(epollFd, listenFd, EPOLLIN, EPOLL_CTL_ADD)
+                || ! watchDescriptor(epollFd, signalFd, EPOLLIN, EPOLL_CTL_ADD)) {
+            for (int fd : {listenFd, signalFd, epollFd}) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            return false;
+        }
+
+        std::unordered_map<int, Connection> connections;
+        std::array<epoll_event, maxServerEvents> events;
+        // Workers are started once for all rounds.
+        QueryWorkers queryWorkers = createQueryWorkers(workerCount);
+        bool running = true;
+
+        while (running) {
+            // SIGUSR1 interrupts the wait, so a report asked for while idle is written right away.
+            writeRequestedStats(statsCollector, network);
+            int eventCount = epoll_wait(epollFd, events.data(), events.size(), -1);
+            if (eventCount < 0 && errno == EINTR) {
+                continue;
+            } else if (eventCount < 0) {
+                break;
+            }
+
+            std::vector<int> readyFds;
+            std::vector<Connection*> receivedConnections;
+            for (int i = 0; i < eventCount; i ++) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptConnections(listenFd, epollFd, connections);
+                    continue;
+                } else if (fd == signalFd) {
+                    running = false;
+                    continue;
+                }
+
+                // A failed connection is left with an empty state, to be closed below.
+                Connection& connection = connections.at(fd);
+                readyFds.push_back(fd);
+                bool isReadable = (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR));
+                if (isReadable && std::get<7>(connection) == CONNECTION_OPEN) {
+                    if (receiveRequests(connection)) {
+                        receivedConnections.push_back(&connection);
+                    } else {
+                        std::get<7>(connection) = CONNECTION_FAILED;
+                    }
+                }
+            }
+
+            // Elements of the map never move, even if accepting rehashed it.
+            handleRequests(receivedConnections, network, queryWorkers, queryCaches, scratchArenas, profile,
+                    statsCollector);
+
+            for (int fd : readyFds) {
+                Connection& connection = connections.at(fd);
+                ConnectionState state = std::get<7>(connection);
+
+                if (state == CONNECTION_FAILED || ! sendResponses(connection)
+                        || (state == CONNECTION_FINISHED && std::get<2>(connection).empty())) {
+                    close(fd);
+                    connections.erase(fd);
+                } else {
+                    updateConnectionEvents(epollFd, connection);
+                }
+            }
+        }
+
+        for (auto& [fd, connection] : connections) {
+            close(fd);
+        }
+        close(epollFd);
+        close(signalFd);
+        close(listenFd);
+        unlink(path);
+
+        return true;
+    }
+
+    // Parses "--name" and "--name=value" arguments.
+    std::optional<Options> parseOptions(int argc, char* argv[]) {
+        Options options;
+
+        for (int i = 1; i < argc; i ++) {
+            std::string_view argument = argv[i];
+            if (argument.substr(0, 2) != "--") {
+                return std::nullopt;
+            }
+            argument.remove_prefix(2);
+
+            std::size_t separator = argument.find('=');
+            std::string_view name = argument.substr(0, separator);
+            std::string_view value = (separator == std::string_view::npos) ? "" : argument.substr(separator + 1);
+
+            if (knownOptions.find(name) == knownOptions.end()) {
+                return std::nullopt;
+            }
+            options[name] = value;
+        }
+
+        return options;
+    }
+
+    inline bool hasOption(const Options& options, std::string_view name) {
+        return (options.find(name) != options.end());
+    }
+
+    // File descriptor for the profile report, from the option or the KASA_PROFILE_FD environment variable.
+    // Returns -1 if not profiling and nullopt if the descriptor is malformed.
+    std::optional<int> getProfileFd(const Options& options) {
+        auto it = options.find("profile-fd");
+        const char* variable = std::getenv("KASA_PROFILE_FD");
+        if (it == options.end() && variable == nullptr) {
+            return -1;
+        }
+
+        auto fd = getNumber((it != options.end()) ? it->second : std::string_view(variable));
+        if (! fd.has_value() || fd.value() > INT_MAX) {
+            return std::nullopt;
+        }
+        return static_cast<int>(fd.value());
+    }
+
+    // Maximal number of tickets in a set, between 1 and maxTicketCount.
+    std::optional<std::size_t> getTicketLimit(const Options& options) {
+        auto it = options.find("max-tickets");
+        if (it == options.end()) {
+            return defaultTicketLimit;
+        }
+
+        auto ticketLimit = getNumber(it->second);
+        if (! ticketLimit.has_value() || ticketLimit.value() == 0 || ticketLimit.value() > maxTicketCount) {
+            return std::nullopt;
+        }
+        return static_cast<std::size_t>(ticketLimit.value());
+    }
+
+    // Number of queries cached by every worker; 0 disables caching.
+    std::optional<std::size_t> getQueryCacheCapacity(const Options& options) {
+        auto it = options.find("query-cache");
+        if (it == options.end()) {
+            return defaultQueryCacheCapacity;
+        }
+
+        auto capacity = getNumber(it->second);
+        if (! capacity.has_value() || capacity.value() > SIZE_MAX) {
+            return std::nullopt;
+        }
+        return static_cast<std::size_t>(capacity.value());
+    }
+
+    // Descriptor statistics reports are written to; -1 if statistics are not collected.
+    std::optional<int> getStatsFd(const Options& options) {
+        auto it = options.find("stats-fd");
+        if (it == options.end()) {
+            return -1;
+        }
+
+        auto fd = getNumber(it->second);
+        if (! fd.has_value() || fd.value() > INT_MAX) {
+            return std::nullopt;
+        }
+        return static_cast<int>(fd.value());
+    }
+
+    // Number of entries of each list of a statistics report, at least 1.
+    std::optional<std::size_t> getStatsTopCount(const Options& options) {
+        auto it = options.find("stats-top");
+        if (it == options.end()) {
+            return defaultStatsTopCount;
+        }
+
+        auto topCount = getNumber(it->second);
+        if (! topCount.has_value() || topCount.value() == 0 || topCount.value() > SIZE_MAX) {
+            return std::nullopt;
+        }
+        return static_cast<std::size_t>(topCount.value());
+    }
+
+    // Number of parser threads of the pipeline, defaultParserCount unless given; 0 if not pipelining.
+    std::optional<unsigned int> getParserCount(const Options& options) {
+        auto it = options.find("pipeline");
+        if (it == options.end()) {
+            return 0;
+        }
+        if (it->second.empty()) {
+            return defaultParserCount;
+        }
+
+        auto parserCount = getNumber(it->second);
+        if (! parserCount.has_value() || parserCount.value() == 0 || parserCount.value() > UINT_MAX) {
+            return std::nullopt;
+        }
+        return static_cast<unsigned int>(parserCount.value());
+    }
+
+    // Interval between syncs of the journal - a checkpoint is recorded with every sync.
+    std::optional<Clock::duration> getJournalSyncInterval(const Options& options) {
+        auto it = options.find("journal-sync-ms");
+        if (it == options.end()) {
+            return defaultJournalSyncInterval;
+        }
+
+        auto milliseconds = getNumber(it->second);
+        if (! milliseconds.has_value() || milliseconds.value() > UINT_MAX) {
+            return std::nullopt;
+        }
+        return std::chrono::milliseconds(milliseconds.value());
+    }
+
+    // Service window written as "h:mm-h:mm" - times past midnight go on counting hours, up to 47:59.
+    std::optional<ServiceWindow> getServiceWindow(const Options& options) {
+        auto it = options.find("service-window");
+        if (it == options.end()) {
+            return defaultServiceWindow;
+        }
+
+        std::size_t pos = 0;
+        auto serviceStart = scanClockTime(it->second, pos);
+        if (! serviceStart.has_value() || ! scanChar(it->second, pos, '-')) {
+            return std::nullopt;
+        }
+        auto serviceEnd = scanClockTime(it->second, pos);
+        if (! serviceEnd.has_value() || pos != it->second.size()
+                || ! isServiceWindowCorrect(ServiceWindow(serviceStart.value(), serviceEnd.value()))) {
+            return std::nullopt;
+        }
+        return ServiceWindow(serviceStart.value(), serviceEnd.value());
+    }
+
+    // Number of threads evaluating queries - all hardware threads unless given.
+    std::optional<unsigned int> getWorkerCount(const Options& options) {
+        auto it = options.find("threads");
+        if (it == options.end()) {
+            return std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        auto workerCount = getNumber(it->second);
+        if (! workerCount.has_value() || workerCount.value() == 0 || workerCount.value() > UINT_MAX) {
+            return std::nullopt;
+        }
+        return static_cast<unsigned int>(workerCount.value());
+    }
+
+    inline bool isNameCorrect(std::string_view name, bool (*isNameChar)(char)) {
+        return (! name.empty() && std::all_of(name.begin(), name.end(), isNameChar));
+    }
+
+    // Names of the networks of a sharded run, written as "name,name" - letters only, none of them repeated. Empty
+    // if the run is not sharded.
+    std::optional<std::vector<std::string_view>> getNetworkNames(const Options& options) {
+        auto it = options.find("networks");
+        if (it == options.end()) {
+            return std::vector<std::string_view>();
+        }
+
+        std::vector<std::string_view> networkNames;
+        std::size_t pos = 0;
+        while (pos <= it->second.size()) {
+            std::size_t nameEnd = std::min(it->second.find(',', pos), it->second.size());
+            std::string_view name = it->second.substr(pos, nameEnd - pos);
+            if (! isNameCorrect(name, isLetterChar)
+                    || std::find(networkNames.begin(), networkNames.end(), name) != networkNames.end()) {
+                return std::nullopt;
+            }
+            networkNames.push_back(name);
+            pos = nameEnd + 1;
+        }
+        return networkNames;
+    }
+
+    // Whether the options suit the run - a sharded one takes none of the unsharded options, and only a sharded one
+    // takes the network output.
+    bool areShardingOptionsCorrect(const Options& options, bool sharded) {
+        if (! sharded) {
+            return ! hasOption(options, "network-output");
+        }
+        return std::none_of(unshardedOptions.begin(), unshardedOptions.end(),
+                [&options](std::string_view name) { return hasOption(options, name); });
+    }
+
+    // Adds a route given by typed stops, checking everything its text line would be checked for. Stops are checked
+    // before any of them is interned, so that a rejected route leaves no trace in the network.
+    bool addRouteStops(LineNum lineNum, const kasa::RouteStop* stops, std::size_t stopCount, Network& network) {
+        if (stopCount == 0 || isLineRepeated(lineNum, std::get<Timetable>(network))) {
+            return false;
+        }
+
+        std::pmr::monotonic_buffer_resource scratch;
+        RouteStopNames stopNames(&scratch);
+        std::optional<StopTime> prevStopTime;
+        for (std::size_t i = 0; i < stopCount; i ++) {
+            const auto& [stopName, stopTime] = stops[i];
+            if (! isNameCorrect(stopName, isStopNameChar)
+                    || ! isStopTimeCorrect(stopTime, prevStopTime, std::get<ServiceWindow>(network))) {
+                return false;
+            }
+            stopNames.emplace_back(stopName, stopTime);
+            prevStopTime = stopTime;
+        }
+
+        if (isStopNameRepeated(stopNames)) {
+            return false;
+        }
+
+        AddRoute addRoute(lineNum, internRouteStops(stopNames, std::get<StopIndex>(network)));
+        return (processAddRoute(addRoute, std::get<Timetable>(network), std::get<StopVisits>(network)).first
+                == NO_RESPONSE);
+    }
+
+    bool addTicketFields(std::string_view name, Price price, ValidTime validTime, Network& network) {
+        if (! isNameCorrect(name, isTicketNameChar) || ! isPriceCorrect(price) || validTime == 0) {
+            return false;
+        }
+
+        AddTicket addTicket(std::pmr::string(name), price, validTime, std::pmr::string());
+        return (processAddTicket(addTicket, std::get<TicketCatalog>(network), std::get<FareClasses>(network),
+                    std::get<TicketEpoch>(network)).first == NO_RESPONSE);
+    }
+
+    // Prices a typed journey just as the equivalent query line, answering with ticket ids instead of names.
+    kasa::Solution solveQuery(const kasa::Query& journey, const Network& network, std::pmr::memory_resource* scratch) {
+        const StopIndex& stopIndex = std::get<StopIndex>(network);
+        kasa::Solution solution(kasa::SOLUTION_ERROR, {0, {}}, noStopId);
+        if (journey.size() < 2) {
+            return solution;
+        }
+
+        // Stops not known to the network do not appear in any route.
+        Query query(scratch);
+        for (const auto& [stopId, lineNum] : journey) {
+            bool isKnown = (stopId < stopIndex.first.size());
+            query.emplace_back(isKnown ? std::string_view(stopIndex.first[stopId]) : std::string_view(), lineNum,
+                    isKnown ? stopId : noStopId);
+        }
+
+        auto countingResult = countTravelTime(query, std::get<Timetable>(network));
+        switch (countingResult.first) {
+            case TRAVEL_TIME_FOUND: {
+                StopTime totalTime = std::get<StopTime>(countingResult.second.value());
+                const TicketSet& best = getUntaggedTicketTable(network).second[totalTime];
+                std::get<0>(solution) = (best.second.first > 0) ? kasa::SOLUTION_FOUND : kasa::SOLUTION_NOT_FOUND;
+                std::get<1>(solution) = best.second;
+                break;
+            }
+            case TRAVEL_TIME_WAIT:
+                std::get<0>(solution) = kasa::SOLUTION_WAIT;
+                std::get<2>(solution) = findStop(std::get<std::string_view>(countingResult.second.value()), stopIndex);
+                break;
+            case TRAVEL_TIME_ERR:
+                break;
+        }
+
+        return solution;
+    }
+
+    // Splits a CSV row into its fields, leaving out a trailing carriage return and the quotes around a field. None
+    // of the columns read may hold a comma, so quoted commas are not looked for.
+    template<typename FieldHandler>
+    void forEachCsvField(std::string_view row, FieldHandler handleField) {
+        if (! row.empty() && row.back() == '\r') {
+            row.remove_suffix(1);
+        }
+
+        for (std::size_t column = 0; ; column ++) {
+            std::size_t comma = row.find(',');
+            std::string_view field = row.substr(0, comma);
+            if (field.size() >= 2 && field.front() == '"' && field.back() == '"') {
+                field = field.substr(1, field.size() - 2);
+            }
+            handleField(column, field);
+
+            if (comma == std::string_view::npos) {
+                return;
+            }
+            row.remove_prefix(comma + 1);
+        }
+    }
+
+    // Positions of the columns read, as named by the header; any other columns are ignored.
+    std::optional<StopTimesColumns> findStopTimesColumns(std::string_view header) {
+        StopTimesColumns columns;
+        columns.fill(SIZE_MAX);
+
+        forEachCsvField(header, [&columns](std::size_t column, std::string_view field) {
+            for (std::size_t i = 0; i < stopTimesColumnNames.size(); i ++) {
+                if (field == stopTimesColumnNames[i] && columns[i] == SIZE_MAX) {
+                    columns[i] = column;
+                }
+            }
+        });
+
+        if (std::find(columns.begin(), columns.end(), SIZE_MAX) != columns.end()) {
+            return std::nullopt;
+        }
+        return columns;
+    }
+
+    inline std::optional<unsigned long long> getCsvNumber(std::string_view field) {
+        return std::all_of(field.begin(), field.end(), isDigitChar) ? getNumber(field) : std::nullopt;
+    }
+
+    // Converts an arrival time written as "h:mm:ss" to minutes; kasa has no seconds, so they have to be zero. Hours
+    // are left for the route checks, which reject anything outside the service window, just as they reject the
+    // time past maxStopTime a malformed arrival time is given.
+    StopTime getStopTimesArrival(std::string_view field) {
+        std::size_t pos = 0;
+        std::string_view strHour = scanWhile(field, pos, isDigitChar);
+        if (strHour.empty() || strHour.size() > 2 || ! scanChar(field, pos, ':')) {
+            return maxStopTime + 1;
+        }
+
+        std::string_view strMinute = scanWhile(field, pos, isDigitChar);
+        if (strMinute.size() != 2 || strMinute[0] > '5' || ! scanChar(field, pos, ':') || field.substr(pos) != "00") {
+            return maxStopTime + 1;
+        }
+
+        return 60 * getNumber(strHour).value() + getNumber(strMinute).value();
+    }
+
+    // Reads the rows of a part of a stop_times file and sorts them into trips. Fails on a row missing a column or
+    // with a trip or a stop sequence that is not a number; the stop and the arrival time are checked with the route.
+    std::optional<std::vector<StopTimesRow>> readStopTimesRows(std::string_view part,
+            const StopTimesColumns& columns) {
+        InputBatch rows;
+        splitInputLines(part, rows, SIZE_MAX);
+        if (! part.empty()) {
+            // The last row does not end with a newline.
+            rows.push_back(part);
+        }
+
+        std::vector<StopTimesRow> stopTimes;
+        stopTimes.reserve(rows.size());
+        for (auto row : rows) {
+            if (row.empty() || row == "\r") {
+                continue;
+            }
+
+            std::array<std::string_view, 4> fields;
+            std::size_t foundCount = 0;
+            forEachCsvField(row, [&](std::size_t column, std::string_view field) {
+                for (std::size_t i = 0; i < columns.size(); i ++) {
+                    if (columns[i] == column) {
+                        fields[i] = field;
+                        foundCount ++;
+                    }
+                }
+            });
+
+            auto trip = getCsvNumber(fields[0]);
+            auto sequence = getCsvNumber(fields[3]);
+            if (foundCount != columns.size() || ! trip.has_value() || ! sequence.has_value()) {
+                return std::nullopt;
+            }
+            stopTimes.emplace_back(trip.value(), sequence.value(), getStopTimesArrival(fields[1]), fields[2]);
+        }
+
+        std::sort(stopTimes.begin(), stopTimes.end());
+        return stopTimes;
+    }
+
+    // Reads the rows of a whole stop_times file, sorted into trips. Workers read parts of the file split at row
+    // boundaries, and their sorted rows are merged.
+    std::optional<std::vector<StopTimesRow>> readStopTimes(std::string_view file, unsigned int workerCount) {
+        static const std::string_view byteOrderMark = "\xEF\xBB\xBF";
+        if (file.substr(0, byteOrderMark.size()) == byteOrderMark) {
+            file.remove_prefix(byteOrderMark.size());
+        }
+
+        std::size_t headerEnd = std::min(file.find('\n'), file.size());
+        auto columns = findStopTimesColumns(file.substr(0, headerEnd));
+        if (! columns.has_value()) {
+            return std::nullopt;
+        }
+        file.remove_prefix(std::min(headerEnd + 1, file.size()));
+
+        std::vector<std::string_view> parts;
+        for (unsigned int worker = 0; worker < workerCount && ! file.empty(); worker ++) {
+            std::size_t partEnd = (worker + 1 < workerCount) ? file.size() / (workerCount - worker) : file.size();
+            partEnd = std::min(file.find('\n', partEnd), file.size());
+            parts.push_back(file.substr(0, partEnd));
+            file.remove_prefix(std::min(partEnd + 1, file.size()));
+        }
+
+        std::vector<std::future<std::optional<std::vector<StopTimesRow>>>> workers;
+        for (std::size_t part = 1; part < parts.size(); part ++) {
+            workers.push_back(std::async(std::launch::async, readStopTimesRows, parts[part], columns.value()));
+        }
+
+        std::optional<std::vector<StopTimesRow>> stopTimes = std::vector<StopTimesRow>();
+        if (! parts.empty()) {
+            stopTimes = readStopTimesRows(parts[0], columns.value());
+        }
+        for (auto& worker : workers) {
+            auto partStopTimes = worker.get();
+            if (! stopTimes.has_value() || ! partStopTimes.has_value()) {
+                stopTimes = std::nullopt;
+                continue;
+            }
+
+            auto& rows = stopTimes.value();
+            std::size_t merged = rows.size();
+            rows.insert(rows.end(), partStopTimes.value().begin(), partStopTimes.value().end());
+            std::inplace_merge(rows.begin(), rows.begin() + merged, rows.end());
+        }
+
+        return stopTimes;
+    }
+
+    // Adds every trip as a route, in a single pass over the sorted rows, with the timetable and the stop visits
+    // sized for all of them up front. A trip is checked just as its route line would be, and it also has to give
+    // every stop a distinct sequence number. Returns the trips rejected.
+    std::vector<LineNum> addStopTimesTrips(const std::vector<StopTimesRow>& stopTimes, Network& network) {
+        std::size_t tripCount = 0;
+        for (std::size_t i = 0; i < stopTimes.size(); i ++) {
+            tripCount += (i == 0 || std::get<0>(stopTimes[i]) != std::get<0>(stopTimes[i - 1]));
+        }
+        reserveTimetable(std::get<Timetable>(network), std::get<Timetable>(network).first + tripCount);
+        std::get<StopVisits>(network).reserve(std::get<StopVisits>(network).size() + stopTimes.size());
+
+        std::vector<LineNum> rejectedTrips;
+        std::vector<kasa::RouteStop> stops;
+        for (std::size_t begin = 0, end = 0; begin < stopTimes.size(); begin = end) {
+            LineNum trip = std::get<0>(stopTimes[begin]);
+            bool isSequenceRepeated = false;
+
+            stops.clear();
+            for (end = begin; end < stopTimes.size() && std::get<0>(stopTimes[end]) == trip; end ++) {
+                const auto& [rowTrip, sequence, arrivalTime, stopName] = stopTimes[end];
+                isSequenceRepeated |= (end > begin && sequence == std::get<1>(stopTimes[end - 1]));
+                stops.emplace_back(stopName, arrivalTime);
+            }
+
+            if (isSequenceRepeated || ! addRouteStops(trip, stops.data(), stops.size(), network)) {
+                rejectedTrips.push_back(trip);
+            }
+        }
+
+        return rejectedTrips;
+    }
+
+    // Imports a GTFS-style stop_times file, each trip as the route of the line numbered as the trip. Returns false
+    // if the file cannot be read or is malformed, in which case nothing is added.
+    bool importStopTimes(const char* path, unsigned int workerCount, Network& network,
+            std::vector<LineNum>& rejectedTrips) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        auto mappedFile = mapInputFile(fd);
+        close(fd);
+        if (! mappedFile.has_value()) {
+            return false;
+        }
+
+        // Stops are copied into the network, so the rows may point into the mapping.
+        auto stopTimes = readStopTimes(mappedFile.value().first, workerCount);
+        if (stopTimes.has_value()) {
+            rejectedTrips = addStopTimesTrips(stopTimes.value(), network);
+        }
+        unmapInput(mappedFile.value());
+
+        return stopTimes.has_value();
+    }
+
+    // Runs the text interface over sharded networks, given options already checked. Responses of the named
+    // networks go to "name.out" and "name.err" in the network output directory, if there is one, and are merged
+    // into the standard streams, tagged, otherwise; the default network always answers on the standard streams.
+    // Returns the exit status.
+    int runShardedCommandLine(const Options& options, const std::vector<std::string_view>& networkNames) {
+        std::size_t ticketLimit = getTicketLimit(options).value_or(defaultTicketLimit);
+        ServiceWindow serviceWindow = getServiceWindow(options).value_or(defaultServiceWindow);
+        bool lineBuffered = hasOption(options, "line-buffered");
+        std::vector<Output> outputs(1, createOutput(lineBuffered));
+        std::deque<std::ofstream> networkStreams;
+
+        auto outputDir = options.find("network-output");
+        if (outputDir != options.end()) {
+            for (auto name : networkNames) {
+                Output& output = outputs.emplace_back(createOutput(lineBuffered));
+                for (OutputStream stream : {STDOUT, STDERR}) {
+                    std::string path = std::string(outputDir->second) + "/" + std::string(name)
+                        + (stream == STDOUT ? ".out" : ".err");
+                    std::ofstream& file = networkStreams.emplace_back(path);
+                    if (! file.is_open()) {
+                        std::cerr << "Cannot open network output " << path << std::endl;
+                        return 1;
+                    }
+                    std::get<0>(output)[stream].first = &file;
+                }
+            }
+        }
+
+        bool allowMapping = ! hasOption(options, "stream-input");
+        auto forEachBatch = [allowMapping](auto handleBatch) {
+            forEachInputBatch(allowMapping, handleBatch);
+        };
+        runShards(forEachBatch, networkNames, ticketLimit, serviceWindow, outputs);
+        for (auto& output : outputs) {
+            flushOutput(output);
+        }
+
+        for (auto& file : networkStreams) {
+            file.close();
+            if (file.fail()) {
+                std::cerr << "Cannot write network output " << outputDir->second << std::endl;
+                return 1;
+            }
+        }
+        return 0;
     }
 }
 
-int main() {
-    std::ios_base::sync_with_stdio(false);
-    std::cin.tie(nullptr);
+namespace kasa {
+    // The arena has to outlive the network, so it is declared first.
+    struct Engine {
+        Engine(std::size_t ticketLimit, const ServiceWindow& serviceWindow)
+            : network(createNetwork(&arena, ticketLimit, serviceWindow)) {}
+
+        std::pmr::monotonic_buffer_resource arena;
+        Network network;
+    };
+
+    EngineHandle createEngine(std::size_t ticketLimit, StopTime serviceStart, StopTime serviceEnd) {
+        auto destroyEngine = [](Engine* engine) { delete engine; };
+        ServiceWindow serviceWindow(serviceStart, serviceEnd);
+        if (ticketLimit == 0 || ticketLimit > maxTicketCount || ! isServiceWindowCorrect(serviceWindow)) {
+            return EngineHandle(nullptr, destroyEngine);
+        }
+
+        return EngineHandle(new Engine(ticketLimit, serviceWindow), destroyEngine);
+    }
+
+    bool addRoute(Engine& engine, LineNum lineNum, const RouteStop* stops, std::size_t stopCount) {
+        return addRouteStops(lineNum, stops, stopCount, engine.network);
+    }
+
+    bool addTicket(Engine& engine, std::string_view name, Price price, ValidTime validTime) {
+        return addTicketFields(name, price, validTime, engine.network);
+    }
+
+    StopId findStop(const Engine& engine, std::string_view name) {
+        return ::findStop(name, std::get<StopIndex>(engine.network));
+    }
+
+    std::string_view getStopName(const Engine& engine, StopId id) {
+        const auto& stopNames = std::get<StopIndex>(engine.network).first;
+        return (id < stopNames.size()) ? std::string_view(stopNames[id]) : std::string_view();
+    }
 
-    TicketMap ticketMap;
-    TicketSortedMap ticketSortedMap;
-    Timetable timetable;
+    std::string_view getTicketName(const Engine& engine, TicketId id) {
+        const TicketCatalog& ticketCatalog = std::get<TicketCatalog>(engine.network);
+        return (id < ticketCatalog.size()) ? std::string_view(std::get<0>(ticketCatalog[id])) : std::string_view();
+    }
 
-    unsigned int ticketCounter = 0;
-    unsigned int lineCounter = 1;
-    std::string buffer;
+    // Journeys are translated in an arena released after each of them, so that typical ones allocate nothing.
+    void solve(const Engine& engine, const Query* queries, std::size_t queryCount, Solution* solutions) {
+        std::array<char, 1 << 12> buffer;
+        std::pmr::monotonic_buffer_resource scratch(buffer.data(), buffer.size());
 
-    while (std::getline(std::cin, buffer)) {
-        ParseResult parseResult = parseInputLine(buffer);
-        ProcessResult processResult = processRequest(parseResult, ticketMap, ticketSortedMap, timetable, ticketCounter);
-        printOutput(processResult, buffer, lineCounter);
-        lineCounter ++;
+        for (std::size_t i = 0; i < queryCount; i ++) {
+            solutions[i] = solveQuery(queries[i], engine.network, &scratch);
+            scratch.release();
+        }
     }
-    printTicketCount(ticketCounter);
 
-    return 0;
+    int runCommandLine(int argc, char* argv[]) {
+        std::ios_base::sync_with_stdio(false);
+        std::cin.tie(nullptr);
+
+        auto options = parseOptions(argc, argv);
+        auto workerCount = options.has_value() ? getWorkerCount(options.value()) : std::nullopt;
+        auto profileFd = options.has_value() ? getProfileFd(options.value()) : std::nullopt;
+        auto ticketLimit = options.has_value() ? getTicketLimit(options.value()) : std::nullopt;
+        auto queryCacheCapacity = options.has_value() ? getQueryCacheCapacity(options.value()) : std::nullopt;
+        auto parserCount = options.has_value() ? getParserCount(options.value()) : std::nullopt;
+        auto syncInterval = options.has_value() ? getJournalSyncInterval(options.value()) : std::nullopt;
+        auto statsFd = options.has_value() ? getStatsFd(options.value()) : std::nullopt;
+        auto statsTopCount = options.has_value() ? getStatsTopCount(options.value()) : std::nullopt;
+        auto serviceWindow = options.has_value() ? getServiceWindow(options.value()) : std::nullopt;
+        auto networkNames = options.has_value() ? getNetworkNames(options.value()) : std::nullopt;
+        if (! workerCount.has_value() || ! profileFd.has_value() || ! ticketLimit.has_value()
+                || ! queryCacheCapacity.has_value() || ! parserCount.has_value() || ! syncInterval.has_value()
+                || ! statsFd.has_value() || ! statsTopCount.has_value() || ! serviceWindow.has_value()
+                || ! networkNames.has_value()
+                || (hasOption(options.value(), "socket") && hasOption(options.value(), "journal"))
+                || ! areShardingOptionsCorrect(options.value(), ! networkNames.value().empty())) {
+            std::cerr << "Usage: " << argv[0] << " [--line-buffered] [--stream-input] [--threads=N]"
+                << " [--profile-fd=FD] [--load-snapshot=PATH] [--save-snapshot=PATH] [--max-tickets=K]"
+                << " [--query-cache=N] [--socket=PATH] [--pipeline[=PARSERS]] [--journal=PATH]"
+                << " [--journal-sync-ms=N] [--stats-fd=FD] [--stats-top=N] [--import-stop-times=PATH]"
+                << " [--service-window=H:MM-H:MM] [--networks=NAME,NAME] [--network-output=DIR]" << std::endl;
+            return 1;
+        }
+
+        unsigned int threadCount = workerCount.value();
+
+        // Every network of a sharded run is owned by its shard, which is the only thread to touch it.
+        if (! networkNames.value().empty()) {
+            return runShardedCommandLine(options.value(), networkNames.value());
+        }
+
+        // The arena has to outlive the network.
+        std::pmr::monotonic_buffer_resource networkArena;
+        Network network = createNetwork(&networkArena, ticketLimit.value(), serviceWindow.value());
+        SnapshotCounters snapshotCounters(0, 0);
+        auto loadPath = options.value().find("load-snapshot");
+        if (loadPath != options.value().end()
+                && ! loadSnapshot(std::string(loadPath->second).c_str(), network, snapshotCounters)) {
+            std::cerr << "Cannot load snapshot " << loadPath->second << std::endl;
+            return 1;
+        }
+
+        // Trips are imported as if their routes came before the input, so that any numbering is unaffected.
+        std::vector<LineNum> rejectedTrips;
+        auto importPath = options.value().find("import-stop-times");
+        if (importPath != options.value().end() && ! importStopTimes(std::string(importPath->second).c_str(),
+                    threadCount, network, rejectedTrips)) {
+            std::cerr << "Cannot import stop times " << importPath->second << std::endl;
+            return 1;
+        }
+        for (LineNum trip : rejectedTrips) {
+            std::cerr << "Error in trip " << trip << std::endl;
+        }
+
+        // A journal resumes the run from its last checkpoint, which has to come after the snapshot.
+        std::optional<Journal> journal;
+        SnapshotCounters resumedCounters = snapshotCounters;
+        auto journalPath = options.value().find("journal");
+        if (journalPath != options.value().end()) {
+            journal = openJournal(std::string(journalPath->second).c_str(), syncInterval.value(), network,
+                    resumedCounters);
+            if (! journal.has_value() || resumedCounters.first < snapshotCounters.first) {
+                std::cerr << "Cannot open journal " << journalPath->second << std::endl;
+                return 1;
+            }
+        }
+
+        std::vector<ProcessResult> results;
+        auto profile = (profileFd.value() >= 0) ? std::make_unique<Profile>() : nullptr;
+        std::vector<QueryCache> queryCaches = createQueryCaches(queryCacheCapacity.value(), threadCount);
+        std::vector<ScratchArena> scratchArenas = createScratchArenas(threadCount);
+        // Every worker collects statistics on its own; the pipeline's processor uses those of the first one.
+        auto statsCollector = (statsFd.value() >= 0)
+            ? std::make_unique<StatsCollector>(std::vector<HotspotStats>(threadCount), statsFd.value(),
+                    statsTopCount.value())
+            : nullptr;
+        if (statsCollector != nullptr && ! handleStatsSignal()) {
+            std::cerr << "Cannot handle SIGUSR1" << std::endl;
+            return 1;
+        }
+
+        auto socketPath = options.value().find("socket");
+        if (socketPath != options.value().end()) {
+            if (! runServer(std::string(socketPath->second).c_str(), network, threadCount, queryCaches, scratchArenas,
+                        profile.get(), statsCollector.get())) {
+                std::cerr << "Cannot listen on " << socketPath->second << std::endl;
+                return 1;
+            }
+            // Clients number their lines on their own.
+            snapshotCounters = SnapshotCounters(0, 0);
+        } else {
+            Output output = createOutput(hasOption(options.value(), "line-buffered"));
+            Journal* journaled = journal.has_value() ? &journal.value() : nullptr;
+
+            // Numbering continues from the snapshot (or the checkpoint), so that lines are reported as if its input
+            // came first. Input already handled before the checkpoint is skipped.
+            unsigned int ticketCounter = resumedCounters.second;
+            unsigned int lineCounter = resumedCounters.first + 1;
+            std::size_t skippedLineCount = resumedCounters.first - snapshotCounters.first;
+
+            bool allowMapping = ! hasOption(options.value(), "stream-input");
+            if (unsigned int parsers = parserCount.value(); parsers > 0) {
+                // The pipeline processes queries on its single processor thread, without the query cache.
+                auto forEachBatch = [allowMapping, skippedLineCount](auto handleBatch) {
+                    forEachRemainingBatch(allowMapping, skippedLineCount, handleBatch);
+                };
+                runPipeline(forEachBatch, parsers, network, ticketCounter, lineCounter, output, journaled,
+                        profile.get(), statsCollector.get());
+            } else {
+                QueryWorkers queryWorkers = createQueryWorkers(threadCount);
+                forEachRemainingBatch(allowMapping, skippedLineCount, [&](const InputBatch& batch) {
+                    processBatch(batch, network, queryWorkers, results, ticketCounter, queryCaches,
+                            scratchArenas, profile.get(), statsCollector.get());
+
+                    Clock::time_point start = startTiming(profile.get());
+                    for (std::size_t i = 0; i < batch.size(); i ++) {
+                        printOutput(results[i], batch[i], lineCounter, output);
+                        lineCounter ++;
+                    }
+                    recordPhase(profile.get(), PHASE_PRINT, start);
+
+                    if (journaled != nullptr) {
+                        journalBatch(*journaled, batch, results);
+                        checkpointJournal(*journaled, SnapshotCounters(lineCounter - 1, ticketCounter), output,
+                                false);
+                    }
+
+                    releaseScratchArenas(scratchArenas, results);
+                    writeRequestedStats(statsCollector.get(), network);
+                });
+            }
+            snapshotCounters = SnapshotCounters(lineCounter - 1, ticketCounter);
+
+            // The final checkpoint comes before the ticket count, so that a resumed run still prints it.
+            if (journaled != nullptr) {
+                checkpointJournal(*journaled, snapshotCounters, output, true);
+            }
+            printTicketCount(ticketCounter, output);
+            flushOutput(output);
+
+            if (journaled != nullptr && ! closeJournal(*journaled)) {
+                std::cerr << "Cannot write journal " << journalPath->second << std::endl;
+                return 1;
+            }
+        }
+
+        auto savePath = options.value().find("save-snapshot");
+        if (savePath != options.value().end()
+                && ! saveSnapshot(std::string(savePath->second).c_str(), network, snapshotCounters)) {
+            std::cerr << "Cannot save snapshot " << savePath->second << std::endl;
+            return 1;
+        }
+
+        if (profile != nullptr) {
+            writeProfile(*profile, queryCaches, profileFd.value());
+        }
+        if (statsCollector != nullptr) {
+            writeStats(*statsCollector, network);
+        }
+
+        return 0;
+    }
 }
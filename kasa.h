@@ -0,0 +1,94 @@
+#ifndef KASA_H
+#define KASA_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Typed interface of libkasa - routes and tickets are added, and batches of journeys priced, without formatting
+// or parsing any text. The kasa executable is a driver over runCommandLine.
+namespace kasa {
+    // Ticket's price, in hundredths.
+    using Price = unsigned long;
+    // Ticket's validity time, in minutes.
+    using ValidTime = unsigned long long;
+    // Ticket's id - the number of tickets added before it.
+    using TicketId = std::uint32_t;
+    // Arrival time at a stop, in minutes since midnight.
+    using StopTime = unsigned long;
+    // Trams run from 5:55 to 21:21, unless configured otherwise.
+    constexpr StopTime defaultServiceStart = 355, defaultServiceEnd = 1281;
+    // Latest time a service may run at - trips past midnight go on counting minutes, up to 47:59.
+    constexpr StopTime maxStopTime = 48 * 60 - 1;
+    // Stop's id - the number of distinct stops added before it.
+    using StopId = std::uint32_t;
+    // Id of a stop name that does not appear in any route.
+    constexpr StopId noStopId = UINT32_MAX;
+    // Line number (id).
+    using LineNum = unsigned long long;
+    // Maximal number of tickets in a set, unless configured otherwise.
+    constexpr std::size_t defaultTicketLimit = 3;
+    // Highest configurable number of tickets in a set.
+    constexpr std::size_t maxTicketCount = 8;
+
+    // Routes, tickets and the tables answering queries - defined by the library only.
+    struct Engine;
+    // Engine owned by the caller.
+    using EngineHandle = std::unique_ptr<Engine, void (*)(Engine*)>;
+    // A stop of a route to add - name and arrival time.
+    using RouteStop = std::pair<std::string_view, StopTime>;
+    // A stop of a journey and the line taken from it (ignored for the last stop).
+    using QueryStop = std::pair<StopId, LineNum>;
+    // A journey to price, from its first stop to its last one.
+    using Query = std::vector<QueryStop>;
+    // Outcome of pricing a journey.
+    enum SolutionType {
+        SOLUTION_FOUND,
+        SOLUTION_WAIT,
+        SOLUTION_NOT_FOUND,
+        SOLUTION_ERROR
+    };
+    // Tickets making up a set - their number and ids.
+    using SolutionTickets = std::pair<std::size_t, std::array<TicketId, maxTicketCount>>;
+    // A priced journey - outcome, cheapest set of tickets (if found) and the stop where the passenger would have to
+    // wait (if so).
+    using Solution = std::tuple<SolutionType, SolutionTickets, StopId>;
+
+    // Creates an empty engine selecting sets of at most ticketLimit tickets (between 1 and maxTicketCount), for
+    // trams running from serviceStart to serviceEnd (at most maxStopTime); the handle is empty if either is not
+    // right.
+    EngineHandle createEngine(std::size_t ticketLimit = defaultTicketLimit, StopTime serviceStart = defaultServiceStart,
+            StopTime serviceEnd = defaultServiceEnd);
+
+    // Adds a route visiting the stops in order. Fails, leaving the engine unchanged, on anything the text input
+    // would reject - a repeated line number, a malformed stop name, times out of order or a repeated stop.
+    bool addRoute(Engine& engine, LineNum lineNum, const RouteStop* stops, std::size_t stopCount);
+
+    // Adds an untagged ticket (of the default fare class). Fails, leaving the engine unchanged, on a malformed name,
+    // one repeated among untagged tickets, a zero price or a zero validity time.
+    bool addTicket(Engine& engine, std::string_view name, Price price, ValidTime validTime);
+
+    // Id of a stop, or noStopId if no route visits it.
+    StopId findStop(const Engine& engine, std::string_view name);
+
+    // Name of a stop by its id; the id must come from findStop or a solution, and an empty name is returned otherwise.
+    std::string_view getStopName(const Engine& engine, StopId id);
+
+    // Name of a ticket by its id; the id must come from a solution, and an empty name is returned otherwise.
+    std::string_view getTicketName(const Engine& engine, TicketId id);
+
+    // Prices queryCount journeys, with untagged tickets, into the caller's solutions. Only reads the engine, so any
+    // number of threads may solve at once, as long as nothing is being added.
+    void solve(const Engine& engine, const Query* queries, std::size_t queryCount, Solution* solutions);
+
+    // Runs the text interface - reads requests from the standard input (or serves them on a socket) and answers
+    // them, just as the kasa executable does. Returns the exit status.
+    int runCommandLine(int argc, char* argv[]);
+}
+
+#endif // KASA_H
@@ -0,0 +1,5 @@
+#include "kasa.h"
+
+int main(int argc, char* argv[]) {
+    return kasa::runCommandLine(argc, argv);
+}
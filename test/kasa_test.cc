@@ -0,0 +1,65 @@
+// Checks kasa's responses to short sequences of lines, each against a network of its own. Lines are handled one by
+// one, the way a batch handles them. The exit status is 1 if any response is not the expected one.
+#include "../kasa.cc"
+
+namespace {
+    // A check - its name and its lines, each with the type of response expected.
+    using Check = std::pair<std::string_view, std::vector<std::pair<std::string_view, ResponseType>>>;
+
+    const std::vector<Check> checks = {
+        // A rejected route leaves no stops behind, so plans from them are errors, not journeys not found.
+        {"route_with_repeated_stop", {
+            {"1 6:00 A 6:10 A", ERROR_RESP},
+            {"2 6:00 B 6:20 C", NO_RESPONSE},
+            {"?? A 6:00 C", ERROR_RESP},
+            {"?? B 6:00 C", PLANNED},
+        }},
+        {"route_with_repeated_line", {
+            {"1 6:00 B 6:20 C", NO_RESPONSE},
+            {"1 7:00 Q 7:10 R", ERROR_RESP},
+            {"?? Q 7:00 R", ERROR_RESP},
+            {"?? B 6:00 C", PLANNED},
+        }},
+        // A removed ticket's name is free again, but the ticket cannot be repriced or removed any more.
+        {"removed_ticket_name", {
+            {"1 6:00 B 6:20 C", NO_RESPONSE},
+            {"T 1.00 30", NO_RESPONSE},
+            {"- T", NO_RESPONSE},
+            {"? B 1 C", NOT_FOUND},
+            {"= T 2.00 30", ERROR_RESP},
+            {"- T", ERROR_RESP},
+            {"T 3.00 30", NO_RESPONSE},
+            {"T 3.00 30", ERROR_RESP},
+            {"= T 2.00 30", NO_RESPONSE},
+            {"? B 1 C", FOUND},
+        }},
+    };
+
+    bool runCheck(const Check& check) {
+        const auto& [name, lines] = check;
+        std::pmr::monotonic_buffer_resource networkArena, scratch;
+        Network network = createNetwork(&networkArena, defaultTicketLimit, defaultServiceWindow);
+        unsigned int ticketCounter = 0;
+        bool passed = true;
+
+        for (const auto& [line, expected] : lines) {
+            ResponseType responseType = handleLine(line, network, ticketCounter, &scratch, nullptr).first;
+            if (responseType != expected) {
+                std::cerr << name << ": \"" << line << "\" got response " << responseType << ", expected "
+                    << expected << std::endl;
+                passed = false;
+            }
+        }
+
+        return passed;
+    }
+}
+
+int main() {
+    std::size_t failed = std::count_if(checks.begin(), checks.end(), [](const Check& check) {
+        return ! runCheck(check);
+    });
+    std::cout << (checks.size() - failed) << " of " << checks.size() << " checks passed" << std::endl;
+
+    return (failed == 0) ? 0 : 1;
+}